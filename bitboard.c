@@ -0,0 +1,355 @@
+#include "chess.h"
+
+uint64_t knight_attacks[64];
+uint64_t king_attacks[64];
+uint64_t pawn_attacks[2][64];
+uint64_t between_bb[64][64];
+uint64_t line_bb[64][64];
+
+/* rays[dir][sq] holds every square from sq to the board edge in
+ * direction dir, not including sq itself */
+static uint64_t rays[8][64];
+
+/* first four directions step towards higher square numbers, the
+ * rest towards lower ones; even directions are orthogonal, odd ones
+ * diagonal */
+static const struct coordinates ray_directions[8] = {
+    { 1, 0 }, { 1, 1 }, { 0, 1 }, { 1, -1 },
+    { -1, 0 }, { -1, -1 }, { 0, -1 }, { -1, 1 },
+};
+
+#define on_board(y, x) ((0 <= (y) && (y) <= 7) && (0 <= (x) && (x) <= 7))
+
+static uint64_t step_mask(int y, int x, const int (*steps)[2], int n)
+{
+    uint64_t mask = 0;
+    for(int i = 0; i < n; ++i)
+    {
+        int ty = y + steps[i][0], tx = x + steps[i][1];
+        if(on_board(ty, tx))
+            mask |= BIT(SQUARE(ty, tx));
+    }
+    return mask;
+}
+
+struct magic_t rook_magics[64];
+struct magic_t bishop_magics[64];
+
+static uint64_t rook_table[102400];
+static uint64_t bishop_table[5248];
+
+/* attacks along one ray, stopping at (and including) the first
+ * blocker */
+static uint64_t ray_attacks(int dir, int sq, uint64_t occ)
+{
+    uint64_t attacks = rays[dir][sq];
+    uint64_t blockers = attacks & occ;
+    if(blockers)
+        attacks ^= rays[dir][dir < 4 ? lsb(blockers) : msb(blockers)];
+    return attacks;
+}
+
+/* reference generator used to fill the lookup tables; rooks use the
+ * even directions, bishops the odd ones */
+static uint64_t slider_attacks_slow(bool rook, int sq, uint64_t occ)
+{
+    uint64_t attacks = 0;
+    for(int dir = rook ? 0 : 1; dir < 8; dir += 2)
+        attacks |= ray_attacks(dir, sq, occ);
+    return attacks;
+}
+
+/* xorshift64*, callers seed the state with a fixed value so the same
+ * numbers come out every run */
+uint64_t rand64(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545f4914f6cdd1dULL;
+}
+
+#if !defined(USE_PEXT) && !defined(FIND_MAGICS)
+/* the magics found by the search below, built with FIND_MAGICS, for
+ * its fixed seed; the search takes the best part of a second, which
+ * every engine start would otherwise pay */
+static const uint64_t rook_magic_numbers[64] = {
+    0x1080004008801020ULL, 0x0840092002c03000ULL, 0x1900200010400900ULL, 0x0880100008000480ULL,
+    0x4200100420080200ULL, 0x8100020100080400ULL, 0x0200040110886200ULL, 0x0200008040220411ULL,
+    0x0404800084400220ULL, 0x0000401000402000ULL, 0x0086001081220440ULL, 0x0408800800100280ULL,
+    0x000a001201040820ULL, 0x8848800200840080ULL, 0x4001000100040200ULL, 0x0442000102105084ULL,
+    0x9080010020804100ULL, 0x0040404000201009ULL, 0x0000808010002009ULL, 0x2200090021d00100ULL,
+    0x0008008008040080ULL, 0x0004004002010040ULL, 0x0011040008015042ULL, 0x00000a0001768104ULL,
+    0x0000800080204009ULL, 0x2010004140002001ULL, 0x9800200280100080ULL, 0x1000100080080080ULL,
+    0x0442000a00049020ULL, 0x2100040080020080ULL, 0x0800120400900148ULL, 0x0010040a00128541ULL,
+    0x2800804000800030ULL, 0x1010002000400041ULL, 0x4000200011004100ULL, 0x0610008410800800ULL,
+    0x0400802402800800ULL, 0xc100020080800400ULL, 0x0002000802000401ULL, 0x0182085882000401ULL,
+    0x0220204000808000ULL, 0x2860100040024022ULL, 0x0001002004110040ULL, 0x99101042000a0020ULL,
+    0x0004080004008080ULL, 0x0010040002008080ULL, 0x2012004881020004ULL, 0x8300842444820011ULL,
+    0x0088403882010200ULL, 0x0820400080210100ULL, 0x0110910040a00300ULL, 0x0801100280080480ULL,
+    0x0242009008200600ULL, 0x1002000489500200ULL, 0x0040800200010080ULL, 0x0091800041000080ULL,
+    0x0000209300488001ULL, 0x04c1002414824001ULL, 0x020020000b001041ULL, 0x7000100004200901ULL,
+    0x8002002004100802ULL, 0x30010002084c0007ULL, 0x0888221800813004ULL, 0x4000002840840112ULL,
+};
+
+static const uint64_t bishop_magic_numbers[64] = {
+    0x10102002004a1420ULL, 0x8020040400584008ULL, 0x10510800811201c8ULL, 0x5204042080000088ULL,
+    0x2204106880000002ULL, 0x1401042004000000ULL, 0x0400880410042004ULL, 0x0028208200a02020ULL,
+    0x1500241990010e00ULL, 0x8001200182020a40ULL, 0x40004101030b0000ULL, 0x8002041042000100ULL,
+    0x4010011041020038ULL, 0x0000010421044000ULL, 0x1500210808020a00ULL, 0x8000088400880520ULL,
+    0x0405004010040100ULL, 0x1005823210040108ULL, 0x2708008102040011ULL, 0x4048200404009100ULL,
+    0x0018104101400024ULL, 0x0003000601190101ULL, 0x8004803108491000ULL, 0x8014241200820800ULL,
+    0x0006e080100c3040ULL, 0x0501044a11041800ULL, 0x9020300008004045ULL, 0x0894080000220040ULL,
+    0x1001010083104000ULL, 0x5004030040900080ULL, 0x000400422c012400ULL, 0x0002128698404812ULL,
+    0x1010108404900440ULL, 0x0928021182084100ULL, 0x2006080409020024ULL, 0x1010202020180080ULL,
+    0xa010008200202200ULL, 0x2098015100019004ULL, 0x0002041440810811ULL, 0x802a02020000b098ULL,
+    0x0009015090004060ULL, 0x4000821082081001ULL, 0x0100210040420800ULL, 0x0800004010488a00ULL,
+    0x2000081104004040ULL, 0x4c8e029015000082ULL, 0x0420340322224842ULL, 0x1298260043400210ULL,
+    0x0000822802400008ULL, 0x00008a0101600000ULL, 0x3040003412080021ULL, 0x3040290220884800ULL,
+    0x4a1500401041004aULL, 0x8010200282020781ULL, 0x0020203142209091ULL, 0x0070300600902110ULL,
+    0x0040808800b62048ULL, 0x0000810400c44420ULL, 0x00080400440c0441ULL, 0x8340080020840411ULL,
+    0x0000000104208200ULL, 0x0000800810d00080ULL, 0x0400530411080200ULL, 0x4040702400932244ULL,
+};
+#endif
+
+static void init_magics(struct magic_t *magics, uint64_t *table, bool rook)
+{
+    static uint64_t occupancy[4096], reference[4096];
+#if !defined(USE_PEXT) && defined(FIND_MAGICS)
+    /* epoch[i] == attempt means table slot i was written during the
+     * current candidate, saves clearing the table between tries */
+    static int epoch[4096];
+    static int attempt = 0;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+#endif
+
+    uint64_t *attacks = table;
+    for(int sq = 0; sq < 64; ++sq)
+    {
+        struct magic_t *m = &magics[sq];
+        uint64_t edges = ((RANK_MASK(0) | RANK_MASK(7)) & ~RANK_MASK(SQ_Y(sq))) |
+            ((FILE_MASK(0) | FILE_MASK(7)) & ~FILE_MASK(SQ_X(sq)));
+        m->mask = slider_attacks_slow(rook, sq, 0) & ~edges;
+        m->shift = 64 - popcount(m->mask);
+        m->attacks = attacks;
+
+        /* enumerate every subset of the mask (carry-rippler) */
+        int size = 0;
+        uint64_t b = 0;
+        do {
+            occupancy[size] = b;
+            reference[size] = slider_attacks_slow(rook, sq, b);
+            ++size;
+            b = (b - m->mask) & m->mask;
+        } while(b);
+
+#ifdef USE_PEXT
+        m->magic = 0;
+        for(int i = 0; i < size; ++i)
+            attacks[magic_index(m, occupancy[i])] = reference[i];
+#elif !defined(FIND_MAGICS)
+        m->magic = (rook ? rook_magic_numbers : bishop_magic_numbers)[sq];
+        for(int i = 0; i < size; ++i)
+            attacks[magic_index(m, occupancy[i])] = reference[i];
+#else
+        for(;;)
+        {
+            /* sparse candidates that spread the mask into the top byte
+             * succeed much more often */
+            do
+                m->magic = rand64(&seed) & rand64(&seed) & rand64(&seed);
+            while(popcount((m->mask * m->magic) >> 56) < 6);
+
+            ++attempt;
+            int i;
+            for(i = 0; i < size; ++i)
+            {
+                unsigned int idx = magic_index(m, occupancy[i]);
+                if(epoch[idx] < attempt)
+                {
+                    epoch[idx] = attempt;
+                    attacks[idx] = reference[i];
+                }
+                else if(attacks[idx] != reference[i])
+                    break;
+            }
+            if(i == size)
+                break;
+        }
+        printf("0x%016"PRIx64"ULL,%c", m->magic, sq % 4 == 3 ? '\n' : ' ');
+#endif
+        attacks += size;
+    }
+}
+
+void init_bitboards(void)
+{
+    static const int knight_steps[8][2] = {
+        { 1, 2 }, { 2, 1 }, { 2, -1 }, { 1, -2 },
+        { -1, 2 }, { -2, 1 }, { -2, -1 }, { -1, -2 },
+    };
+    static const int king_steps[8][2] = {
+        { 0, 1 }, { 1, 1 }, { 1, 0 }, { 1, -1 },
+        { 0, -1 }, { -1, -1 }, { -1, 0 }, { -1, 1 },
+    };
+    static const int white_pawn_steps[2][2] = { { 1, -1 }, { 1, 1 } };
+    static const int black_pawn_steps[2][2] = { { -1, -1 }, { -1, 1 } };
+
+    for(int sq = 0; sq < 64; ++sq)
+    {
+        int y = SQ_Y(sq), x = SQ_X(sq);
+        knight_attacks[sq] = step_mask(y, x, knight_steps, 8);
+        king_attacks[sq] = step_mask(y, x, king_steps, 8);
+        pawn_attacks[0][sq] = step_mask(y, x, white_pawn_steps, 2);
+        pawn_attacks[1][sq] = step_mask(y, x, black_pawn_steps, 2);
+
+        for(int dir = 0; dir < 8; ++dir)
+        {
+            rays[dir][sq] = 0;
+            int ty = y + ray_directions[dir].y, tx = x + ray_directions[dir].x;
+            while(on_board(ty, tx))
+            {
+                rays[dir][sq] |= BIT(SQUARE(ty, tx));
+                ty += ray_directions[dir].y;
+                tx += ray_directions[dir].x;
+            }
+        }
+    }
+
+    /* needs every ray, so done in a second pass */
+    for(int sq = 0; sq < 64; ++sq)
+    {
+        for(int dir = 0; dir < 8; ++dir)
+        {
+            uint64_t line = rays[dir][sq] | rays[(dir + 4) % 8][sq] | BIT(sq);
+            uint64_t between = 0;
+            uint64_t ray = rays[dir][sq];
+            while(ray)
+            {
+                /* walk outwards from sq */
+                int to = dir < 4 ? lsb(ray) : msb(ray);
+                ray ^= BIT(to);
+                between_bb[sq][to] = between;
+                line_bb[sq][to] = line;
+                between |= BIT(to);
+            }
+        }
+    }
+
+    init_magics(rook_magics, rook_table, true);
+    init_magics(bishop_magics, bishop_table, false);
+}
+
+/* squares attacked by a piece standing on sq, own pieces included */
+uint64_t piece_attacks(int type, int color, int sq, uint64_t occ)
+{
+    switch(type)
+    {
+    case PAWN:
+        return pawn_attacks[COLOR_IDX(color)][sq];
+    case ROOK:
+        return rook_attacks(sq, occ);
+    case KNIGHT:
+        return knight_attacks[sq];
+    case BISHOP:
+        return bishop_attacks(sq, occ);
+    case QUEEN:
+        return rook_attacks(sq, occ) | bishop_attacks(sq, occ);
+    case KING:
+        return king_attacks[sq];
+    default:
+        return 0;
+    }
+}
+
+/* every square attacked by a set of pawns of the given color */
+uint64_t pawn_attacks_bb(uint64_t pawns, int color)
+{
+    if(color == WHITE)
+        return ((pawns << 7) & ~FILE_MASK(7)) | ((pawns << 9) & ~FILE_MASK(0));
+    return ((pawns >> 9) & ~FILE_MASK(7)) | ((pawns >> 7) & ~FILE_MASK(0));
+}
+
+/* pieces of the given color attacking sq, with occ as the blockers */
+uint64_t attackers_to(const struct chess_ctx *ctx, int sq, uint64_t occ, int color)
+{
+    const uint64_t *p = ctx->pieces;
+    uint64_t queens = p[QUEEN - 1];
+    uint64_t attackers =
+        (pawn_attacks[COLOR_IDX(inv_player(color))][sq] & p[PAWN - 1]) |
+        (knight_attacks[sq] & p[KNIGHT - 1]) |
+        (king_attacks[sq] & p[KING - 1]) |
+        (rook_attacks(sq, occ) & (p[ROOK - 1] | queens)) |
+        (bishop_attacks(sq, occ) & (p[BISHOP - 1] | queens));
+    return attackers & ctx->occupied[COLOR_IDX(color)];
+}
+
+/* pieces of the given color that are the only thing standing between
+ * an enemy slider and the king on ksq */
+uint64_t pinned_pieces(const struct chess_ctx *ctx, int color, int ksq)
+{
+    const uint64_t *p = ctx->pieces;
+    uint64_t own = ctx->occupied[COLOR_IDX(color)];
+    uint64_t occ = all_occupied(ctx);
+    uint64_t snipers = ((rook_attacks(ksq, 0) & (p[ROOK - 1] | p[QUEEN - 1])) |
+                        (bishop_attacks(ksq, 0) & (p[BISHOP - 1] | p[QUEEN - 1]))) &
+        ctx->occupied[COLOR_IDX(inv_player(color))];
+    uint64_t pinned = 0;
+    while(snipers)
+    {
+        uint64_t blockers = between_bb[ksq][pop_lsb(&snipers)] & occ;
+        if(popcount(blockers) == 1)
+            pinned |= blockers & own;
+    }
+    return pinned;
+}
+
+/* the attack maps last worked out on this thread and the key of the
+ * position they belong to; a new key means they're out of date */
+static __thread struct {
+    uint64_t key;
+    uint64_t attacks[2]; /* [color idx] */
+    uint8_t valid; /* bit per color idx */
+} attack_cache;
+
+/* whether color's attack map for ctx is already known, and if so what
+ * it is */
+bool attacks_cached(const struct chess_ctx *ctx, int color, uint64_t *attacks)
+{
+    int idx = COLOR_IDX(color);
+    if(attack_cache.key != ctx->key || !(attack_cache.valid & (1 << idx)))
+        return false;
+    *attacks = attack_cache.attacks[idx];
+    return true;
+}
+
+/* squares attacked by color, looked up in this thread's cache when
+ * they can be. The enemy king is left off the board, so it can't step
+ * back along a slider's line and still look safe */
+uint64_t attacked_squares(const struct chess_ctx *ctx, int color)
+{
+    uint64_t attacks;
+    if(attacks_cached(ctx, color, &attacks))
+        return attacks;
+
+    int idx = COLOR_IDX(color);
+    const uint64_t *p = ctx->pieces;
+    uint64_t own = ctx->occupied[idx];
+    uint64_t occ = all_occupied(ctx) & ~(p[KING - 1] & ~own);
+    attacks = pawn_attacks_bb(p[PAWN - 1] & own, color);
+    uint64_t pieces = own & ~p[PAWN - 1];
+    while(pieces)
+    {
+        int sq = pop_lsb(&pieces);
+        attacks |= piece_attacks(type_at(ctx, sq), color, sq, occ);
+    }
+
+    if(attack_cache.key != ctx->key)
+    {
+        attack_cache.key = ctx->key;
+        attack_cache.valid = 0;
+    }
+    attack_cache.attacks[idx] = attacks;
+    attack_cache.valid |= 1 << idx;
+    return attacks;
+}
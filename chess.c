@@ -1,7 +1,7 @@
 #include "chess.h"
 
 #define DEFAULT_DEPTH 3
-#define MAX_DEPTH 5
+#define MAX_DEPTH 64
 
 //#define AUTOMATCH
 #define UCI
@@ -22,128 +22,170 @@ static const int piece_values[] = { 0,
                                     0  /* king, value doesn't matter */
 };
 
+/* the balance of material and piece-square bonuses from color's point
+ * of view, tapered from the middlegame to the endgame score as pieces
+ * come off */
 int count_material(const struct chess_ctx *ctx, int color)
 {
-    int total = 0;
-    for(int y = 0; y < 8; ++y)
-    {
-        for(int x = 0; x < 8; ++x)
-        {
-            if(ctx->board[y][x].color == color)
-            {
-                total += piece_values[ctx->board[y][x].type];
-                total += location_bonuses[ctx->board[y][x].type - 1][color == WHITE ? y : 7 - y][x];
+    int phase = MIN(ctx->phase, PHASE_MAX); /* promotions can push it past */
+    int total = (ctx->psq[0] * phase + ctx->psq[1] * (PHASE_MAX - phase)) / PHASE_MAX;
+    return color == WHITE ? total : -total;
+}
 
-#if 0
-                /* pawn near promotion */
-                if(ctx->board[y][x].type == PAWN)
-                {
-                    if((y >= 5 && ctx->board[y][x].color == WHITE) ||
-                       (y <= 2 && ctx->board[y][x].color == BLACK))
-                        total += 4;
+/* mobility: the number of squares each piece attacks that aren't
+ * held by its own side or covered by an enemy pawn, with enemy pieces
+ * counting twice and three times if nothing defends them. Taken from
+ * attack sets, so pins and checks are ignored; pawns and kings are
+ * left to the piece-square tables */
+int count_space(const struct chess_ctx *ctx, int color)
+{
+    int idx = COLOR_IDX(color);
+    uint64_t occ = all_occupied(ctx);
+    uint64_t enemy = ctx->occupied[COLOR_IDX(inv_player(color))];
+    uint64_t safe = ~ctx->occupied[idx] &
+        ~pawn_attacks_bb(ctx->pieces[PAWN - 1] & enemy, inv_player(color));
 
-                    /* pawns are more valuable the further they have advanced */
-                    total += ctx->board[y][x].color == WHITE ? y : 7 - y;
-                }
-                if(ctx->board[y][x].type == KING && (y == 2 || y == 6)) /* castled king */
-                    total += 20;
-#endif
-            }
-        }
+    /* the cached attack map: quiesce() has already worked out the one
+     * against the side to move, looking for check */
+    uint64_t loose = enemy & ~ctx->pieces[KING - 1] &
+        ~attacked_squares(ctx, inv_player(color));
+
+    int space = 0;
+    uint64_t pieces = ctx->occupied[idx] & ~(ctx->pieces[PAWN - 1] | ctx->pieces[KING - 1]);
+    while(pieces)
+    {
+        int sq = pop_lsb(&pieces);
+        uint64_t attacks = piece_attacks(type_at(ctx, sq), color, sq, occ) & safe;
+        space += popcount(attacks) + popcount(attacks & enemy) + popcount(attacks & loose);
     }
-    //printf("color %d has %d material\n", color, total);
-    return total;
+    //printf("color %d has %d space\n", color, space);
+    return space;
 }
 
-bool count_space_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
+/* pawn structure weights, [0=middlegame,1=endgame] */
+static const int doubled_penalty[2] = { 10, 20 };
+static const int isolated_penalty[2] = { 10, 15 };
+static const int backward_penalty[2] = { 8, 10 };
+static const int passed_bonus[2][8] = { /* [][rank, from the pawn's side] */
+    { 0, 5, 10, 15, 25, 40, 60, 0 },
+    { 0, 10, 20, 35, 60, 90, 130, 0 },
+};
+
+/* every square on the ranks ahead of rank y, as seen by color */
+static uint64_t ranks_ahead(int color, int y)
 {
-    int *count = data;
-    (*count)++;
-    if(move.type == NORMAL)
-    {
-        int x = move.data.normal.to.x, y = move.data.normal.to.y;
-        if(ctx->board[y][x].color != NONE) /* threatens an enemy piece */
-            (*count)++;
-#if 0
-        if((x == 3 || x == 4) && (y == 3 || y == 4)) /* controls center */
-            (*count)++;
-#endif
+    if(color == WHITE)
+        return y == 7 ? 0 : ~0ULL << (8 * (y + 1));
+    return (1ULL << (8 * y)) - 1;
+}
+
+static uint64_t adjacent_files(int x)
+{
+    return ((FILE_MASK(x) << 1) & ~FILE_MASK(0)) | ((FILE_MASK(x) >> 1) & ~FILE_MASK(7));
+}
+
+/* adds color's doubled, isolated, backward and passed pawn terms to
+ * score, white ahead being positive */
+static void eval_pawns_side(const struct chess_ctx *ctx, int color, int score[2])
+{
+    int sign = color == WHITE ? 1 : -1;
+    uint64_t pawns = ctx->pieces[PAWN - 1];
+    uint64_t own = pawns & ctx->occupied[COLOR_IDX(color)];
+    uint64_t enemy = pawns & ctx->occupied[COLOR_IDX(inv_player(color))];
+    uint64_t enemy_attacks = pawn_attacks_bb(enemy, inv_player(color));
+
+    uint64_t left = own;
+    while(left)
+    {
+        int sq = pop_lsb(&left);
+        int y = SQ_Y(sq), x = SQ_X(sq);
+        int rank = color == WHITE ? y : 7 - y;
+        uint64_t ahead = ranks_ahead(color, y);
+        uint64_t neighbours = own & adjacent_files(x);
+        int stop = color == WHITE ? sq + 8 : sq - 8;
+        int mg = 0, eg = 0;
+
+        /* the rearmost pawn of a doubled pair takes the penalty */
+        bool doubled = own & FILE_MASK(x) & ahead;
+        if(doubled)
+            mg -= doubled_penalty[0], eg -= doubled_penalty[1];
+
+        /* backward: every neighbour has gone past it, so none can ever
+         * defend it, and an enemy pawn stops it catching up */
+        if(!neighbours)
+            mg -= isolated_penalty[0], eg -= isolated_penalty[1];
+        else if(!(neighbours & ~ahead) && (enemy_attacks & BIT(stop)))
+            mg -= backward_penalty[0], eg -= backward_penalty[1];
+
+        if(!doubled && !(enemy & ahead & (FILE_MASK(x) | adjacent_files(x))))
+            mg += passed_bonus[0][rank], eg += passed_bonus[1][rank];
+
+        score[0] += sign * mg;
+        score[1] += sign * eg;
     }
-    return true;
 }
 
-/* essentially returns the total of the number of squares each piece
- * can move to */
-int count_space(const struct chess_ctx *ctx, int color)
+/* pawn structure, tapered like count_material() and from color's point
+ * of view. The terms depend on nothing but the pawns, so they're looked
+ * up by the pawn key before being worked out */
+int count_pawns(const struct chess_ctx *ctx, int color)
 {
-    int space = 0;
-    for(int y = 0; y < 8; ++y)
+    int score[2];
+    if(!pawn_hash_probe(ctx->pawn_key, score))
     {
-        for(int x = 0; x < 8; ++x)
-        {
-            if(ctx->board[y][x].color == color)
-            {
-                for_each_move(ctx, y, x, count_space_cb, &space, true, true);
-            }
-        }
+        score[0] = score[1] = 0;
+        eval_pawns_side(ctx, WHITE, score);
+        eval_pawns_side(ctx, BLACK, score);
+        pawn_hash_store(ctx->pawn_key, score);
     }
-    //printf("color %d has %d space\n", color, space);
-    return space;
-}
 
-#define inv_player(p) ((p)==WHITE?BLACK:WHITE)
+    int phase = MIN(ctx->phase, PHASE_MAX);
+    int total = (score[0] * phase + score[1] * (PHASE_MAX - phase)) / PHASE_MAX;
+    return color == WHITE ? total : -total;
+}
 
-bool king_in_checkmate(const struct chess_ctx *ctx, int color)
+bool king_in_checkmate(struct chess_ctx *ctx, int color)
 {
     struct coordinates king;
     if(king_in_check(ctx, color, &king))
     {
         /* check that there are no legal moves */
-        return count_space(ctx, color) == 0;
+        struct move_list list;
+        return gen_moves(ctx, color, &list, GEN_ALL) == 0;
     }
     return false;
 }
 
-int eval_position(const struct chess_ctx *ctx, int color)
+int eval_position(struct chess_ctx *ctx, int color)
 {
     int score = 0;
 
 //    score += count_material(ctx, color) * 4;
 //    score -= count_material(ctx, inv_player(color)) * 2;
     score += count_material(ctx, color);
-    score -= count_material(ctx, inv_player(color));
     score += count_space(ctx, color);
     score -= count_space(ctx, inv_player(color));
+    score += count_pawns(ctx, color);
 
 #if 0
     if(can_castle(ctx, color, QUEENSIDE) || can_castle(ctx, color, KINGSIDE))
         score += 25;
 #endif
 
-    if(king_in_check(ctx, color, NULL))
-    {
+    /* mates are found by the search, which knows when there are no
+     * moves left */
 #ifdef CHECK_PENALTIES
+    if(king_in_check(ctx, color, NULL))
         score -= 9;
-#endif
-        if(king_in_checkmate(ctx, color))
-            score -= 200000;
-    }
     else if(king_in_check(ctx, inv_player(color), NULL))
-    {
-#ifdef CHECK_PENALTIES
         score += 5;
 #endif
-        if(king_in_checkmate(ctx, inv_player(color)))
-            score += 200000;
-    }
 
     return score;
 }
 
 #define valid_coords(y, x) ((0 <= y && y <= 7) && (0 <= x && x <= 7))
 
-int location_bonuses[6][8][8];
-
 static const int location_bonuses_early[6][8][8] =  {
     {
         // Pawns - early/mid
@@ -228,6 +270,17 @@ static const int location_bonuses_endgame[6][8][8] = {
         { 82, 82, 82, 82, 82, 82, 82, 82 }, // 7
         { 0,  0,  0,  0,  0,  0,  0,  0 }, // 8
     },
+    // Rooks - endgame
+    { //  A   B   C   D   E   F   G   H
+        { -32,-31,-30,-29,-29,-30,-31,-32 }, // 1
+        { -27,-25,-24,-24,-24,-24,-25,-27 }, // 2
+        { -15,-13,-12,-12,-12,-12,-13,-15 }, // 3
+        { 1,  2,  3,  4,  4,  3,  2,  1 }, // 4
+        { 15, 17, 18, 18, 18, 18, 17, 15 }, // 5
+        { 25, 27, 28, 28, 28, 28, 27, 25 }, // 6
+        { 27, 28, 29, 30, 30, 29, 28, 27 }, // 7
+        { 16, 17, 18, 19, 19, 18, 17, 16 },  // 8
+    },
     // Knights - endgame
     { //  A   B   C   D   E   F   G   H
         { -99,-99,-94,-88,-88,-94,-99,-99 }, // 1
@@ -249,17 +302,6 @@ static const int location_bonuses_endgame[6][8][8] = {
         { 13, 19, 23, 25, 25, 23, 19, 13 }, // 6
         { 8, 14, 18, 20, 20, 18, 14,  8 }, // 7
         { -2,  4,  8, 10, 10,  8,  4, -2 },  // 8
-    },{
-        // Rooks - endgame
-        //  A   B   C   D   E   F   G   H
-        { -32,-31,-30,-29,-29,-30,-31,-32 }, // 1
-        { -27,-25,-24,-24,-24,-24,-25,-27 }, // 2
-        { -15,-13,-12,-12,-12,-12,-13,-15 }, // 3
-        { 1,  2,  3,  4,  4,  3,  2,  1 }, // 4
-        { 15, 17, 18, 18, 18, 18, 17, 15 }, // 5
-        { 25, 27, 28, 28, 28, 28, 27, 25 }, // 6
-        { 27, 28, 29, 30, 30, 29, 28, 27 }, // 7
-        { 16, 17, 18, 19, 19, 18, 17, 16 },  // 8
     },{
         // Queens - endgame
         //  A   B   C   D   E   F   G   H
@@ -285,460 +327,248 @@ static const int location_bonuses_endgame[6][8][8] = {
     }
 };
 
-const struct coordinates king_moves[] = {
-    { 0, 1 },
-    { 1, 1 },
-    { 1, 0 },
-    { 1, -1 },
-    { 0, -1 },
-    { -1, -1 },
-    { -1, 0 },
-    { -1, 1 },
-    { COORD_END, COORD_END },
-};
-
-const struct coordinates rook_directions[] = {
-    { 0, 1 },
-    { 1, 0 },
-    { 0, -1 },
-    { -1, 0 },
-    { COORD_END, COORD_END },
-};
-
-const struct coordinates queen_directions[] = {
-    { 0, 1 },
-    { 1, 1 },
-    { 1, 0 },
-    { 1, -1 },
-    { 0, -1 },
-    { -1, -1 },
-    { -1, 0 },
-    { -1, 1 },
-    { COORD_END, COORD_END },
-};
-
-const struct coordinates bishop_directions[] = {
-    { 1, 1 },
-    { 1, -1 },
-    { -1, -1 },
-    { -1, 1 },
-    { COORD_END, COORD_END },
-};
-
-const struct coordinates knight_moves[] = {
-    { 1, 2 },
-    { 2, 1 },
-    { 2, -1 },
-    { 1, -2 },
-    { -1, 2 },
-    { -2, 1 },
-    { -2, -1 },
-    { -1, -2 },
-    { COORD_END, COORD_END }
-};
-
-const struct coordinates *line_moves[] = {
-    NULL,
-    NULL,
-    rook_directions,
-    NULL,
-    bishop_directions,
-    queen_directions,
-    NULL
-};
-
-const struct coordinates *jump_moves[] = {
-    NULL,
-    NULL,
-    NULL,
-    knight_moves,
-    NULL,
-    NULL,
-    king_moves,
-};
-
-#define friendly_occupied(ctx, y, x, c) ((ctx)->board[(y)][(x)].color == NONE ? false : ((ctx)->board[(y)][(x)].color == (c)))
-
-#if 0
-bool friendly_occupied(const struct chess_ctx *ctx, int y, int x, int color)
+bool king_in_check(struct chess_ctx *ctx, int color, struct coordinates *king)
 {
-    if(!valid_coords(y, x))
-        return false;
-    const struct piece_t *piece = &ctx->board[y][x];
-    if(piece->type == EMPTY)
+    uint64_t kings = ctx->pieces[KING - 1] & ctx->occupied[COLOR_IDX(color)];
+    if(!kings)
         return false;
-    switch(piece->color)
-    {
-    case NONE:
-        return false;
-    case WHITE:
-        return color == WHITE;
-    case BLACK:
-        return color == BLACK;
-    default:
-        assert(false);
-    }
-}
-#endif
-
-#define enemy_occupied(ctx, y, x, c) (valid_coords((y),(x))?((ctx)->board[(y)][(x)].color == NONE ? false : ((ctx)->board[(y)][(x)].color == inv_player(c))):false)
 
-#if 0
-bool enemy_occupied(const struct chess_ctx *ctx, int y, int x, int color)
-{
-    if(!valid_coords(y, x))
-        return false;
-    const struct piece_t *piece = &ctx->board[y][x];
-    if(piece->type == EMPTY)
-        return false;
-    switch(piece->color)
-    {
-    case NONE:
+    int sq = lsb(kings);
+    if(!(attacked_squares(ctx, inv_player(color)) & BIT(sq)))
         return false;
-    case WHITE:
-        return color == BLACK;
-    case BLACK:
-        return color == WHITE;
-    default:
-        assert(false);
-    }
+
+    if(king)
+        *king = (struct coordinates) { SQ_Y(sq), SQ_X(sq) };
+    return true;
 }
-#endif
 
-#define occupied(ctx, y, x) (valid_coords((y),(x))?((ctx)->board[(y)][(x)].color != NONE):false)
+/* more than any exchange could win, so the king is never given up */
+#define SEE_KING_VALUE 100000
 
-struct check_info {
-    int color;
-    bool checked;
-    struct coordinates king;
-};
+/* order in which attackers are thrown into an exchange */
+static const int see_order[] = { PAWN, KNIGHT, BISHOP, ROOK, QUEEN, KING };
 
-bool detect_check_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
+/* static exchange evaluation: the material the mover comes out with
+ * if both sides keep recapturing on the target square, cheapest piece
+ * first, for as long as it pays. Sliders lined up behind each other
+ * join in as the pieces in front leave. Only attack sets are looked
+ * at, so pins and checks are ignored */
+int see(const struct chess_ctx *ctx, uint16_t move)
 {
-    struct check_info *info = data;
-    int x, y;
-    if(move.type == NORMAL)
-    {
-        x = move.data.normal.to.x;
-        y = move.data.normal.to.y;
-    }
-    else if(move.type == PROMOTION)
-    {
-        x = move.data.promotion.to.x;
-        y = move.data.promotion.to.y;
-    }
-    else
-        return true;
+    int from = MOVE_FROM(move), to = MOVE_TO(move);
+    int piece = type_at(ctx, from), promotion = MOVE_PROMOTION(move);
+    int color = mailbox_get(ctx, from) > 0 ? WHITE : BLACK;
+    if(!move || (piece == KING && ABS(SQ_X(to) - SQ_X(from)) == 2))
+        return 0;
+    if(promotion)
+        piece = promotion;
 
-    if(ctx->board[y][x].type == KING && ctx->board[y][x].color == info->color)
+    const uint64_t *p = ctx->pieces;
+    uint64_t occ = all_occupied(ctx) ^ BIT(from);
+    int gain[32], d = 0;
+    gain[0] = piece_values[type_at(ctx, to)];
+    if(promotion)
+        gain[0] += piece_values[piece] - piece_values[PAWN];
+    else if(piece == PAWN && SQ_X(from) != SQ_X(to) && !type_at(ctx, to))
     {
-        info->king.y = y;
-        info->king.x = x;
-        info->checked = true;
-        return false;
+        /* en passant */
+        gain[0] = piece_values[PAWN];
+        occ ^= BIT(SQUARE(SQ_Y(from), SQ_X(to)));
     }
-    return true;
-}
 
-bool king_in_check(const struct chess_ctx *ctx, int color, struct coordinates *king)
-{
-    struct check_info info;
-    info.color = color;
-    info.checked = false;
-    for(int y = 0; y < 8; ++y)
+    uint64_t diagonal = p[BISHOP - 1] | p[QUEEN - 1];
+    uint64_t straight = p[ROOK - 1] | p[QUEEN - 1];
+    uint64_t attackers = (attackers_to(ctx, to, occ, WHITE) |
+                          attackers_to(ctx, to, occ, BLACK)) & occ;
+    int on_square = piece == KING ? SEE_KING_VALUE : piece_values[piece];
+    int side = inv_player(color);
+    for(;;)
     {
-        for(int x = 0; x < 8; ++x)
+        uint64_t own = attackers & ctx->occupied[COLOR_IDX(side)];
+        if(!own)
+            break;
+        int type = 0;
+        uint64_t bb = 0;
+        for(unsigned i = 0; i < ARRAYLEN(see_order) && !bb; ++i)
+            bb = own & p[(type = see_order[i]) - 1];
+
+        ++d;
+        gain[d] = on_square - gain[d - 1];
+        /* side loses out whether it takes or not, and taking can't
+         * turn out any better for it, so the result's sign is known */
+        if(MAX(-gain[d - 1], gain[d]) < 0)
         {
-            /* check enemy pieces */
-            if(ctx->board[y][x].color == inv_player(color))
-            {
-                for_each_move(ctx, y, x, detect_check_cb, &info, false, false);
-                if(info.checked)
-                    goto early;
-            }
+            --d;
+            break;
         }
-    }
-early:
-    if(info.checked)
-    {
-        if(king)
-            *king = info.king;
-    }
-    return info.checked;
-}
-
-struct threatened_info {
-    bool threatened;
-    int y, x;
-};
-
-bool threatened_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
-{
-    (void) ctx;
-    struct threatened_info *info = data;
-
-    int x, y;
-    if(move.type == NORMAL)
-    {
-        x = move.data.normal.to.x;
-        y = move.data.normal.to.y;
-    }
-    else if(move.type == PROMOTION)
-    {
-        x = move.data.promotion.to.x;
-        y = move.data.promotion.to.y;
-    }
-    else
-        return true;
 
-    if(y == info->y && x == info->x)
-    {
-        info->threatened = true;
-        return false;
+        occ ^= bb & -bb;
+        attackers |= (bishop_attacks(to, occ) & diagonal) | (rook_attacks(to, occ) & straight);
+        attackers &= occ;
+        on_square = type == KING ? SEE_KING_VALUE : piece_values[type];
+        side = inv_player(side);
     }
-    return true;
-}
 
-/* color is friendly */
-/* checks whether enemy threatens a square */
-bool square_threatened(const struct chess_ctx *ctx, int ty, int tx, int color)
-{
-    struct threatened_info info;
-    info.threatened = false;
-    info.y = ty;
-    info.x = tx;
-
-    for(int y = 0; y < 8; ++y)
+    /* either side may stop capturing when that's better for it */
+    while(d)
     {
-        for(int x = 0; x < 8; ++x)
-        {
-            /* check enemy pieces */
-            if(ctx->board[y][x].color == inv_player(color))
-            {
-                for_each_move(ctx, y, x, threatened_cb, &info, false, false);
-                if(info.threatened)
-                    return true;
-            }
-        }
+        gain[d - 1] = -MAX(-gain[d - 1], gain[d]);
+        --d;
     }
-    return false;
+    return gain[0];
 }
 
-struct move_t construct_move(int color, int y, int x, int dy, int dx)
-{
-    struct move_t ret;
-    ret.color = color;
-    ret.type = NORMAL;
-    ret.data.normal.from = (struct coordinates) { y, x };
-    ret.data.normal.to = (struct coordinates) { y + dy, x + dx };
-    return ret;
-}
 
-inline bool gen_and_call(const struct chess_ctx *ctx,
-                         int y, int x,
-                         int dy, int dx,
-                         bool (*cb)(void *data, const struct chess_ctx*, struct move_t),
-                         void *data, bool enforce_check)
+/* appends from -> to, expanding promotions */
+static void add_move(struct chess_ctx *ctx, struct move_list *list, int from, int to)
 {
-    struct move_t move = construct_move(ctx->board[y][x].color,
-                                        y, x,
-                                        dy, dx);
-
-    bool promotion = false;
-    if(ctx->board[y][x].type == PAWN &&
-       (y + dy == 0 || y + dy == 7))
-        promotion = true;
-
-    /* move is to castle, must be before next if(), as it relies on it
-     * to make sure it's legal */
-    if(ctx->board[y][x].type == KING && ABS(dx) == 2)
-    {
-        move.type = CASTLE;
-        move.data.castle_style = dx > 0 ? KINGSIDE : QUEENSIDE;
-    }
-
-    if(enforce_check)
-    {
-        struct chess_ctx local = *ctx;
-        execute_move(&local, move);
-        bool check_after = king_in_check(&local, ctx->board[y][x].color, NULL);
-
-        /* move puts player in check */
-        if(check_after)
-            return true;
-    }
-
-    if(promotion)
+    if(type_at(ctx, from) == PAWN && (SQ_Y(to) == 0 || SQ_Y(to) == 7))
     {
-        move.type = PROMOTION;
-        move.data.promotion.from = (struct coordinates) { y, x  };
-        move.data.promotion.to = (struct coordinates) { y + dy, x + dx };
-
         /* try all possible pieces */
-        enum piece promote_pieces[] = { ROOK, KNIGHT, BISHOP, QUEEN };
+        static const enum piece promote_pieces[] = { QUEEN, KNIGHT, ROOK, BISHOP };
         for(unsigned int i = 0; i < ARRAYLEN(promote_pieces); ++i)
-        {
-            move.data.promotion.type = promote_pieces[i];
-            if(!cb(data, ctx, move))
-                return false;
-        }
-        return true;
+            list->moves[list->count++] = MOVE(from, to) | promote_pieces[i] << 12;
     }
     else
-    {
-        return cb(data, ctx, move);
-    }
+        list->moves[list->count++] = MOVE(from, to);
 }
 
-void for_each_move(const struct chess_ctx *ctx,
-                   int y, int x,
-                   bool (*cb)(void *data, const struct chess_ctx*, struct move_t),
-                   void *data, bool enforce_check, bool consider_castle)
+/* en passant removes two pieces from the capturing pawn's rank, which
+ * can uncover a check the pin test can't see, so look at the king from
+ * scratch with the resulting occupancy */
+static bool en_passant_legal(const struct chess_ctx *ctx, int color, int ksq,
+                             int from, int to)
 {
-    assert(valid_coords(y, x));
-
-    const struct piece_t *piece = &ctx->board[y][x];
-
-    switch(piece->type)
-    {
-    case EMPTY:
-        return;
-    case PAWN:
-    {
-        /* special case */
-        int dy = (piece->color == WHITE ? 1 : -1);
+    if(ksq < 0)
+        return true;
 
-        if(!valid_coords(y + dy, x))
-            break;
+    const uint64_t *p = ctx->pieces;
+    int captured = SQUARE(SQ_Y(from), SQ_X(to));
+    uint64_t occ = (all_occupied(ctx) ^ BIT(from) ^ BIT(captured)) | BIT(to);
+    uint64_t enemy = ctx->occupied[COLOR_IDX(inv_player(color))] & ~BIT(captured);
+    uint64_t attackers =
+        (rook_attacks(ksq, occ) & (p[ROOK - 1] | p[QUEEN - 1])) |
+        (bishop_attacks(ksq, occ) & (p[BISHOP - 1] | p[QUEEN - 1])) |
+        (knight_attacks[ksq] & p[KNIGHT - 1]) |
+        (pawn_attacks[COLOR_IDX(color)][ksq] & p[PAWN - 1]);
+    return !(attackers & enemy);
+}
 
-        /* en passant */
-        if((piece->color == WHITE && y == 4) ||
-           (piece->color == BLACK && y == 3))
+/* fills list with the legal moves of color; GEN_CAPTURES gives captures
+ * and promotions, GEN_QUIETS everything else (castling included).
+ * Checkers and pinned pieces are worked out once up front, so no move
+ * has to be tried on the board */
+int gen_moves(struct chess_ctx *ctx, int color, struct move_list *list, int stage)
+{
+    int idx = COLOR_IDX(color);
+    uint64_t own = ctx->occupied[idx], enemy = ctx->occupied[!idx];
+    uint64_t occ = own | enemy;
+    uint64_t promo_rank = RANK_MASK(color == WHITE ? 7 : 0);
+    int up = color == WHITE ? 8 : -8;
+
+    list->count = 0;
+
+    /* evasions limits where non-king pieces may go: anywhere, onto the
+     * checker or the squares between it and the king, or nowhere when
+     * in double check */
+    int ksq = -1;
+    uint64_t pinned = 0, evasions = ~0ULL;
+    uint64_t kings = ctx->pieces[KING - 1] & own;
+    if(kings)
+    {
+        ksq = lsb(kings);
+        uint64_t checkers = attackers_to(ctx, ksq, occ, inv_player(color));
+        if(checkers)
+            evasions = popcount(checkers) > 1 ? 0 : checkers | between_bb[ksq][lsb(checkers)];
+        pinned = pinned_pieces(ctx, color, ksq);
+    }
+
+    uint64_t pawns = ctx->pieces[PAWN - 1] & own;
+    while(pawns)
+    {
+        int from = pop_lsb(&pawns);
+        int y = SQ_Y(from);
+        uint64_t targets = 0;
+        uint64_t push = BIT(from + up) & ~occ;
+
+        if(stage != GEN_QUIETS)
         {
-            /* piece to right */
-            int opp = piece->color == WHITE ? 1 : 0;
-            if(valid_coords(y + dy, x + 1) && ctx->en_passant[opp][x + 1])
-            {
-                if(!gen_and_call(ctx, y, x, dy, 1, cb, data, enforce_check))
-                    return;
-            }
-            if(valid_coords(y + dy, x - 1) && ctx->en_passant[opp][x - 1])
-            {
-                if(!gen_and_call(ctx, y, x, dy, -1, cb, data, enforce_check))
-                    return;
-            }
-        }
+            targets |= pawn_attacks[idx][from] & enemy;
+            targets |= push & promo_rank;
 
-        /* 2 squares on first move */
-        if((ctx->board[y][x].color == WHITE && y == 1) ||
-           (ctx->board[y][x].color == BLACK && y == 6))
-            if(!occupied(ctx, y + 2 * dy, x) && !occupied(ctx, y + dy, x))
-                if(!gen_and_call(ctx, y, x, 2 * dy, 0, cb, data, enforce_check))
-                    return;
+            /* en passant */
+            if(ctx->ep_square >= 0 && (pawn_attacks[idx][from] & BIT(ctx->ep_square)) &&
+               en_passant_legal(ctx, color, ksq, from, ctx->ep_square))
+                add_move(ctx, list, from, ctx->ep_square);
+        }
 
-        for(int dx = -1; dx <= 1; dx += 2)
+        if(stage != GEN_CAPTURES)
         {
-            if(enemy_occupied(ctx, y + dy, x + dx, piece->color))
-            {
-                if(!gen_and_call(ctx, y, x, dy, dx, cb, data, enforce_check))
-                    return;
-            }
+            targets |= push & ~promo_rank;
+
+            /* 2 squares on first move */
+            if(push && y == (color == WHITE ? 1 : 6))
+                targets |= BIT(from + 2 * up) & ~occ;
         }
 
-        if(!occupied(ctx, y + dy, x))
-            if(!gen_and_call(ctx, y, x, dy, 0, cb, data, enforce_check))
-                return;
-        break;
+        targets &= evasions;
+        if(pinned & BIT(from))
+            targets &= line_bb[ksq][from];
+        while(targets)
+            add_move(ctx, list, from, pop_lsb(&targets));
     }
-    case ROOK:
-    case BISHOP:
-    case QUEEN:
+
+    uint64_t mask = ~own;
+    if(stage == GEN_CAPTURES)
+        mask = enemy;
+    else if(stage == GEN_QUIETS)
+        mask = ~occ;
+
+    for(int type = ROOK; type <= QUEEN; ++type)
     {
-        const struct coordinates *dir = line_moves[piece->type];
-        while(dir->x != COORD_END)
+        uint64_t pieces = ctx->pieces[type - 1] & own;
+        while(pieces)
         {
-            bool clear = true;
-            for(int i = 1; i < 8 && clear; ++i)
-            {
-                struct coordinates d = { i * dir->y, i * dir->x };
-                clear = valid_coords(y + d.y, x + d.x);
-                if(!clear)
-                    break;
-                if(!occupied(ctx, y + d.y, x + d.x))
-                {
-                    if(!gen_and_call(ctx, y, x, d.y, d.x, cb, data, enforce_check))
-                        return;
-                }
-                else
-                {
-                    /* occupied square */
-                    if(enemy_occupied(ctx, y + d.y, x + d.x, piece->color))
-                        if(!gen_and_call(ctx, y, x, d.y, d.x, cb, data, enforce_check))
-                            return;
-                    clear = false;
-                }
-            }
-            ++dir;
+            int from = pop_lsb(&pieces);
+            uint64_t targets = piece_attacks(type, color, from, occ) & mask & evasions;
+            if(pinned & BIT(from))
+                targets &= line_bb[ksq][from];
+            while(targets)
+                add_move(ctx, list, from, pop_lsb(&targets));
         }
-        break;
     }
-    case KNIGHT:
-    case KING:
-    {
-        const struct coordinates *moves = jump_moves[piece->type];
 
-        /* castling */
-        if(piece->type == KING && consider_castle)
+    if(ksq >= 0)
+    {
+        /* the king itself must not block the attacks on the squares it
+         * steps back onto, which the attack map already allows for.
+         * Only a few squares need looking at, so the map is used if
+         * something else has worked it out but isn't built for this */
+        uint64_t targets = king_attacks[ksq] & mask, enemy_attacks;
+        bool cached = attacks_cached(ctx, inv_player(color), &enemy_attacks);
+        if(cached)
+            targets &= ~enemy_attacks;
+        while(targets)
         {
-            if(x == 4 && (y == 0 || y == 7))
-            {
-                if(can_castle(ctx, piece->color, QUEENSIDE))
-                    if(!gen_and_call(ctx, y, x, 0, -2, cb, data, false))
-                        return;
-                if(can_castle(ctx, piece->color, KINGSIDE))
-                    if(!gen_and_call(ctx, y, x, 0, 2, cb, data, false))
-                        return;
-            }
+            int to = pop_lsb(&targets);
+            if(cached ||
+               !attackers_to(ctx, to, occ ^ BIT(ksq), inv_player(color)))
+                add_move(ctx, list, ksq, to);
         }
+    }
 
-        while(moves->x != COORD_END)
+    /* castling, can_castle() already makes sure it's legal */
+    if(stage != GEN_CAPTURES)
+    {
+        for(int style = QUEENSIDE; style <= KINGSIDE; ++style)
         {
-            struct coordinates d = *moves;
-            if(valid_coords(y + d.y, x + d.x))
-            {
-                if(!occupied(ctx, y + d.y, x + d.x))
-                {
-                    if(!gen_and_call(ctx, y, x, d.y, d.x, cb, data, enforce_check))
-                        return;
-                }
-                else
-                {
-                    /* occupied square */
-                    if(enemy_occupied(ctx, y + d.y, x + d.x, piece->color))
-                        if(!gen_and_call(ctx, y, x, d.y, d.x, cb, data, enforce_check))
-                            return;
-                }
-            }
-            ++moves;
+            if(can_castle(ctx, color, style))
+                list->moves[list->count++] = MOVE(ksq, ksq + (style == KINGSIDE ? 2 : -2));
         }
-        break;
-    }
-    default:
-        assert(false);
     }
-}
-
-struct best_data {
-    int highest_score;
-    int depth;
-    struct move_t best_found;
-};
 
-struct worst_data {
-    int lowest_score;
-    int depth;
-    struct move_t worst_found;
-};
+    return list->count;
+}
 
 void print_ctx(const struct chess_ctx *ctx)
 {
@@ -747,8 +577,9 @@ void print_ctx(const struct chess_ctx *ctx)
         printf("  +----+----+----+----+----+----+----+----+\n%d ", y + 1);
         for(int x = 0; x < 8; ++x)
         {
-            char c = " PRNBQK"[ctx->board[y][x].type];
-            if(ctx->board[y][x].color == BLACK)
+            struct piece_t piece = piece_at(ctx, SQUARE(y, x));
+            char c = " PRNBQK"[piece.type];
+            if(piece.color == BLACK)
                 printf("| *%c ", c);
             else
                 printf("|  %c ", c);
@@ -761,6 +592,7 @@ void print_ctx(const struct chess_ctx *ctx)
         printf("%c    ", 'A' + i);
     }
     printf("\n");
+    printf("key %016"PRIx64"\n", ctx->key);
 }
 
 const char *piece_name(enum piece type)
@@ -777,209 +609,294 @@ const char *piece_name(enum piece type)
     return names[type];
 }
 
-void print_move(const struct chess_ctx *ctx, struct move_t move)
+/* prints a move in long algebraic notation, 0000 for none */
+static void print_lan(uint16_t move)
 {
-    switch(move.type)
+    if(!move)
+    {
+        printf("0000");
+        return;
+    }
+    int from = MOVE_FROM(move), to = MOVE_TO(move), promotion = MOVE_PROMOTION(move);
+    printf("%c%c%c%c", 'a' + SQ_X(from), '1' + SQ_Y(from), 'a' + SQ_X(to), '1' + SQ_Y(to));
+    if(promotion)
+        putchar("  rnbq"[promotion]);
+}
+
+/* ctx is the position before the move, for naming the pieces */
+void print_move(const struct chess_ctx *ctx, uint16_t move)
+{
+    if(move == NOMOVE)
     {
-    case NOMOVE:
 #ifndef UCI
         printf("No move.\n");
 #endif
         return;
-    case NORMAL:
-    {
-        /* TODO: sanity checks */
-        //printf("move from %d, %d to %d, %d",
-        //       move.data.normal.from.x, move.data.normal.from.y,
-        //       move.data.normal.to.x, move.data.normal.to.y);
-        const struct piece_t *to, *from;
-        to = &ctx->board[move.data.normal.to.y][move.data.normal.to.x];
-        from = &ctx->board[move.data.normal.from.y][move.data.normal.from.x];
-
-        (void) to;
-        (void) from;
-
-        char name[3];
-        name[0] = 'a' + move.data.normal.to.x;
-        name[1] = '1' + move.data.normal.to.y;
-        name[2] = '\0';
-
-#ifdef UCI
-        char fromname[3];
-        fromname[0] = 'a' + move.data.normal.from.x;
-        fromname[1] = '1' + move.data.normal.from.y;
-        fromname[2] = '\0';
-        printf("%s%s\n", fromname, name);
-#else
-        if(to->type != EMPTY)
-        {
-            printf("%s takes %s at %s\n", piece_name(from->type), piece_name(to->type), name);
-        }
-        else
-        {
-            printf("%s to %s\n", piece_name(from->type), name);
-        }
-#endif
-        break;
     }
-    case PROMOTION:
-    {
+
 #ifdef UCI
-        char name[3];
-        name[0] = 'a' + move.data.promotion.to.x;
-        name[1] = '1' + move.data.promotion.to.y;
-        name[2] = '\0';
-
-        char fromname[3];
-        fromname[0] = 'a' + move.data.promotion.from.x;
-        fromname[1] = '1' + move.data.promotion.from.y;
-        fromname[2] = '\0';
-        char piecename[2];
-        piecename[0] = "  rnbq"[move.data.promotion.type];
-        piecename[1] = '\0';
-        printf("%s%s%s\n", fromname, name, piecename);
+    (void) ctx;
+    print_lan(move);
+    printf("\n");
 #else
+    int from = MOVE_FROM(move), to = MOVE_TO(move);
+    struct piece_t moved = piece_at(ctx, from), captured = piece_at(ctx, to);
+    char name[3] = { 'a' + SQ_X(to), '1' + SQ_Y(to), '\0' };
+    if(MOVE_PROMOTION(move))
         printf("pawn promoted\n");
+    else if(moved.type == KING && ABS(SQ_X(to) - SQ_X(from)) == 2)
+        printf("castles %s\n", SQ_X(to) > SQ_X(from) ? "kingside" : "queenside");
+    else if(captured.type != EMPTY)
+        printf("%s takes %s at %s\n", piece_name(moved.type), piece_name(captured.type), name);
+    else
+        printf("%s to %s\n", piece_name(moved.type), name);
 #endif
-        break;
-    }
-    case CASTLE:
+}
+
+static uint64_t zobrist_pieces[2][6][64]; /* [color idx][type - 1][square] */
+static uint64_t zobrist_castle[16]; /* indexed by the castling rights */
+static uint64_t zobrist_en_passant[8]; /* [file] */
+static uint64_t zobrist_black; /* black to move */
+
+void init_zobrist(void)
+{
+    uint64_t seed = 0x5851f42d4c957f2dULL;
+    for(int c = 0; c < 2; ++c)
+        for(int t = 0; t < 6; ++t)
+            for(int sq = 0; sq < 64; ++sq)
+                zobrist_pieces[c][t][sq] = rand64(&seed);
+    for(int i = 0; i < 16; ++i)
+        zobrist_castle[i] = rand64(&seed);
+    for(int i = 0; i < 8; ++i)
+        zobrist_en_passant[i] = rand64(&seed);
+    zobrist_black = rand64(&seed);
+}
+
+/* hash of everything but the pieces, which put_piece() and
+ * remove_piece() fold in as they go */
+static uint64_t state_key(const struct chess_ctx *ctx)
+{
+    return zobrist_castle[ctx->castling] ^
+        (ctx->ep_square >= 0 ? zobrist_en_passant[SQ_X(ctx->ep_square)] : 0) ^
+        (ctx->to_move == BLACK ? zobrist_black : 0);
+}
+
+uint64_t compute_key(const struct chess_ctx *ctx)
+{
+    uint64_t key = state_key(ctx);
+    uint64_t pieces = all_occupied(ctx);
+    while(pieces)
     {
-#ifdef UCI
-        const char *castle_lan[2][2] = { { "e1c1", "e1g1" },
-                                         { "e8c8", "e8g8" } };
-        printf("%s\n", castle_lan[move.color == WHITE ? 0 : 1][move.data.castle_style]);
-#else
-        printf("castles %s\n", move.data.castle_style == KINGSIDE ? "kingside" : "queenside");
-#endif
-        break;
-    }
-    default:
-        assert(false);
+        int sq = pop_lsb(&pieces);
+        struct piece_t piece = piece_at(ctx, sq);
+        key ^= zobrist_pieces[COLOR_IDX(piece.color)][piece.type - 1][sq];
     }
+    return key;
 }
 
-void execute_move(struct chess_ctx *ctx, struct move_t move)
+/* how much each piece type counts towards the game phase */
+static const int phase_weights[] = { 0, 0, 2, 1, 1, 4, 0 };
+
+/* adds (sign 1) or takes away (sign -1) a piece's share of the
+ * incremental evaluation */
+static void update_psq(struct chess_ctx *ctx, int sq, int type, int color, int sign)
 {
-    memset(&ctx->en_passant[move.color == WHITE ? 0 : 1], 0, sizeof(ctx->en_passant[0]));
-    switch(move.type)
-    {
-    case NORMAL:
-    {
-        /* TODO: sanity checks */
-        //printf("move from %d, %d to %d, %d",
-        //       move.data.normal.from.x, move.data.normal.from.y,
-        //       move.data.normal.to.x, move.data.normal.to.y);
-        struct piece_t *to, *from;
-        to = &ctx->board[move.data.normal.to.y][move.data.normal.to.x];
-        from = &ctx->board[move.data.normal.from.y][move.data.normal.from.x];
+    int y = color == WHITE ? SQ_Y(sq) : 7 - SQ_Y(sq), x = SQ_X(sq);
+    int side = sign * color; /* black's pieces count against white */
+    ctx->psq[0] += side * (piece_values[type] + location_bonuses_early[type - 1][y][x]);
+    ctx->psq[1] += side * (piece_values[type] + location_bonuses_endgame[type - 1][y][x]);
+    ctx->phase += sign * phase_weights[type];
+}
 
-        if(from->type == PAWN)
-        {
-            /* see if we've moved two squares ahead */
-            if(ABS(move.data.normal.to.y - move.data.normal.from.y) == 2)
-                ctx->en_passant[move.color == WHITE ? 0 : 1][move.data.normal.to.x] = true;
-            else if(move.data.normal.to.x - move.data.normal.from.x != 0 && to->type == EMPTY)
-            {
-                /* en passant capture */
-                ctx->board[move.data.normal.from.y][move.data.normal.to.x].type = EMPTY;
-                ctx->board[move.data.normal.from.y][move.data.normal.to.x].color = NONE;
-            }
-        }
-        if(from->type == KING)
-        {
-            ctx->king_moved[move.color == WHITE ? 0 : 1] = true;
-        }
-        else if(from->type == ROOK && (move.data.normal.from.x == 0 || move.data.normal.from.x == 7))
+static void put_piece(struct chess_ctx *ctx, int sq, int type, int color)
+{
+    ctx->pieces[type - 1] |= BIT(sq);
+    ctx->occupied[COLOR_IDX(color)] |= BIT(sq);
+    mailbox_set(ctx, sq, type * color);
+    ctx->key ^= zobrist_pieces[COLOR_IDX(color)][type - 1][sq];
+    if(type == PAWN)
+        ctx->pawn_key ^= zobrist_pieces[COLOR_IDX(color)][PAWN - 1][sq];
+    update_psq(ctx, sq, type, color, 1);
+}
+
+static void remove_piece(struct chess_ctx *ctx, int sq)
+{
+    struct piece_t piece = piece_at(ctx, sq);
+    if(piece.type == EMPTY)
+        return;
+    ctx->pieces[piece.type - 1] &= ~BIT(sq);
+    ctx->occupied[COLOR_IDX(piece.color)] &= ~BIT(sq);
+    mailbox_set(ctx, sq, EMPTY);
+    ctx->key ^= zobrist_pieces[COLOR_IDX(piece.color)][piece.type - 1][sq];
+    if(piece.type == PAWN)
+        ctx->pawn_key ^= zobrist_pieces[COLOR_IDX(piece.color)][PAWN - 1][sq];
+    update_psq(ctx, sq, piece.type, piece.color, -1);
+}
+
+/* castling rights lost when a piece moves from or to each square */
+static const uint8_t castle_lost[64] = {
+    [SQUARE(0, 0)] = CASTLE_BIT(0, QUEENSIDE),
+    [SQUARE(0, 4)] = CASTLE_BIT(0, QUEENSIDE) | CASTLE_BIT(0, KINGSIDE),
+    [SQUARE(0, 7)] = CASTLE_BIT(0, KINGSIDE),
+    [SQUARE(7, 0)] = CASTLE_BIT(1, QUEENSIDE),
+    [SQUARE(7, 4)] = CASTLE_BIT(1, QUEENSIDE) | CASTLE_BIT(1, KINGSIDE),
+    [SQUARE(7, 7)] = CASTLE_BIT(1, KINGSIDE),
+};
+
+/* plays a move for the side to move on ctx, saving what unmake_move()
+ * needs in undo */
+void make_move(struct chess_ctx *ctx, uint16_t move, struct undo_t *undo)
+{
+    int color = ctx->to_move;
+    undo->captured = EMPTY;
+    undo->captured_sq = -1;
+    undo->castling = ctx->castling;
+    undo->ep_square = ctx->ep_square;
+    undo->key = ctx->key;
+    undo->halfmove = ctx->halfmove;
+
+    if(move == NOMOVE)
+        return;
+
+    ++ctx->halfmove;
+
+    ctx->key ^= state_key(ctx);
+    ctx->ep_square = -1;
+
+    int from = MOVE_FROM(move), to = MOVE_TO(move);
+    int type = type_at(ctx, from);
+    int captured_sq = to;
+    if(type == PAWN)
+    {
+        ctx->halfmove = 0;
+        /* see if we've moved two squares ahead */
+        if(ABS(SQ_Y(to) - SQ_Y(from)) == 2)
+            ctx->ep_square = (from + to) / 2;
+        else if(SQ_X(to) != SQ_X(from) && type_at(ctx, to) == EMPTY)
         {
-            ctx->rook_moved[move.color == WHITE ? 0 : 1][move.data.normal.from.x == 0 ? 0 : 1] = true;
+            /* en passant capture */
+            captured_sq = SQUARE(SQ_Y(from), SQ_X(to));
         }
-
-        *to = *from;
-        *from = (struct piece_t){ EMPTY, NONE };
-        break;
+        if(MOVE_PROMOTION(move))
+            type = MOVE_PROMOTION(move);
     }
-    case PROMOTION:
+    else if(type == KING && ABS(SQ_X(to) - SQ_X(from)) == 2)
     {
-        struct piece_t *to, *from;
-        to = &ctx->board[move.data.promotion.to.y][move.data.promotion.to.x];
-        from = &ctx->board[move.data.promotion.from.y][move.data.promotion.from.x];
-        *from = (struct piece_t) { EMPTY, NONE };
-        *to = (struct piece_t) { move.data.promotion.type, move.color };
-        break;
-    }
-    case CASTLE:
-    {
-        int y = move.color == BLACK ? 7 : 0;
-        int dx = move.data.castle_style == KINGSIDE ? 2 : -2;
-        ctx->board[y][4].type = EMPTY;
-        ctx->board[y][4].color = NONE;
-        ctx->board[y][4+dx].type = KING;
-        ctx->board[y][4+dx].color = move.color;
-        int rx = move.data.castle_style == QUEENSIDE ? 0 : 7;
-        ctx->board[y][rx].type = EMPTY;
-        ctx->board[y][rx].color = NONE;
-        ctx->board[y][4+dx/2].type = ROOK;
-        ctx->board[y][4+dx/2].color = move.color;
-        ctx->king_moved[move.color == WHITE ? 0 : 1] = true;
-        break;
+        /* castling: the rook jumps to the square the king crosses */
+        remove_piece(ctx, SQUARE(SQ_Y(from), SQ_X(to) > SQ_X(from) ? 7 : 0));
+        put_piece(ctx, (from + to) / 2, ROOK, color);
     }
-    case NOMOVE:
-        return;
-    default:
-        assert(false);
+    /* a king or rook leaving home, or a rook taken on its square */
+    ctx->castling &= ~(castle_lost[from] | castle_lost[to]);
+
+    if(type_at(ctx, captured_sq))
+    {
+        ctx->halfmove = 0;
+        undo->captured = mailbox_get(ctx, captured_sq);
+        undo->captured_sq = captured_sq;
+        remove_piece(ctx, captured_sq);
     }
+    remove_piece(ctx, from);
+    put_piece(ctx, to, type, color);
+
     ctx->to_move = inv_player(ctx->to_move);
+    ctx->key ^= state_key(ctx);
     //print_ctx(ctx);
 }
 
-struct legal_data {
-    struct move_t move;
-    bool legal;
-};
+/* passes the turn, for null move pruning; the side to move gives up
+ * its en passant chances just as make_move() would */
+static void make_null_move(struct chess_ctx *ctx, struct undo_t *undo)
+{
+    undo->ep_square = ctx->ep_square;
+    undo->key = ctx->key;
+    undo->halfmove = ctx->halfmove;
 
-bool legal_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
+    /* a null move isn't a move that can be repeated, so like a capture
+     * it cuts the positions before it off from repetition checks */
+    ctx->halfmove = 0;
+
+    ctx->key ^= state_key(ctx);
+    ctx->ep_square = -1;
+    ctx->to_move = inv_player(ctx->to_move);
+    ctx->key ^= state_key(ctx);
+}
+
+static void unmake_null_move(struct chess_ctx *ctx, const struct undo_t *undo)
 {
-    (void) ctx;
-    struct legal_data *info = data;
-    switch(info->move.type)
-    {
-    case PROMOTION:
-    case CASTLE:
+    ctx->to_move = inv_player(ctx->to_move);
+    ctx->ep_square = undo->ep_square;
+    ctx->key = undo->key;
+    ctx->halfmove = undo->halfmove;
+}
+
+/* takes back a move played by make_move() */
+void unmake_move(struct chess_ctx *ctx, uint16_t move, const struct undo_t *undo)
+{
+    if(move == NOMOVE)
+        return;
+
+    int color = inv_player(ctx->to_move);
+    ctx->castling = undo->castling;
+    ctx->ep_square = undo->ep_square;
+
+    int from = MOVE_FROM(move), to = MOVE_TO(move);
+    int type = MOVE_PROMOTION(move) ? PAWN : type_at(ctx, to);
+    remove_piece(ctx, to);
+    put_piece(ctx, from, type, color);
+    if(type == KING && ABS(SQ_X(to) - SQ_X(from)) == 2)
     {
-        if(move.type == info->move.type &&
-           move.type == CASTLE ? move.data.castle_style == info->move.data.castle_style : true)
-        {
-            info->legal = true;
-            return false;
-        }
-        break;
+        remove_piece(ctx, (from + to) / 2);
+        put_piece(ctx, SQUARE(SQ_Y(from), SQ_X(to) > SQ_X(from) ? 7 : 0), ROOK, color);
     }
-    case NORMAL:
+
+    if(undo->captured)
+        put_piece(ctx, undo->captured_sq, ABS(undo->captured),
+                  undo->captured > 0 ? WHITE : BLACK);
+    ctx->to_move = color;
+    ctx->key = undo->key;
+    ctx->halfmove = undo->halfmove;
+}
+
+static void push_key(struct key_history *history, uint64_t key)
+{
+    assert(history->len < MAX_HISTORY);
+    history->keys[history->len++] = key;
+}
+
+/* plays a move for good, adding the position it leaves to history.
+ * That is trimmed to what can still repeat, so it doesn't grow with
+ * the length of the game */
+void execute_move(struct chess_ctx *ctx, struct key_history *history, uint16_t move)
+{
+    struct undo_t undo;
+    push_key(history, ctx->key);
+    make_move(ctx, move, &undo);
+
+    int keep = MIN(ctx->halfmove, 100);
+    if(history->len > keep)
     {
-        struct coordinates *to = &move.data.normal.to;
-        struct coordinates *comp = &info->move.data.normal.to;
-        if(to->x == comp->x && to->y == comp->y)
-        {
-            info->legal = true;
-            return false;
-        }
-        break;
+        memmove(history->keys, history->keys + history->len - keep,
+                keep * sizeof(history->keys[0]));
+        history->len = keep;
     }
-    default:
-        assert(false);
-    }
-    return true;
 }
 
-bool can_castle(const struct chess_ctx *ctx, int color, int style)
+/* whether the position came up before, since the last capture or
+ * pawn move. The side to move has to be the same, and it takes at
+ * least four plies to get back */
+bool is_repetition(const struct chess_ctx *ctx, const struct key_history *history)
 {
-    int k_idx = color == WHITE ? 0 : 1;
-    if(ctx->king_moved[k_idx])
-        return false;
+    int back = MIN(ctx->halfmove, history->len);
+    for(int i = 4; i <= back; i += 2)
+        if(history->keys[history->len - i] == ctx->key)
+            return true;
+    return false;
+}
 
-    int r_idx = style == QUEENSIDE ? 0 : 1;
-    if(ctx->rook_moved[k_idx][r_idx])
+bool can_castle(struct chess_ctx *ctx, int color, int style)
+{
+    if(!(ctx->castling & CASTLE_BIT(COLOR_IDX(color), style)))
         return false;
 
     int start = (style == QUEENSIDE ? 1 : 5);
@@ -988,154 +905,115 @@ bool can_castle(const struct chess_ctx *ctx, int color, int style)
     int y = color == WHITE ? 0 : 7;
 
     int rx = style == QUEENSIDE ? 0 : 7;
-    if(ctx->board[y][rx].type != ROOK ||
-       ctx->board[y][rx].color != color)
+    if(mailbox_get(ctx, SQUARE(y, rx)) != ROOK * color)
         return false;
 
     bool clear = true;
     for(int i = start; i <= end; ++i)
-        if(ctx->board[y][i].type != EMPTY)
+        if(type_at(ctx, SQUARE(y, i)) != EMPTY)
             clear = false;
 
     if(clear)
     {
         int dx = style == QUEENSIDE ? -1 : 1;
-        if(!square_threatened(ctx, y, 4 + dx, color) &&
-           !square_threatened(ctx, y, 4 + 2*dx, color))
-            if(!king_in_check(ctx, color, NULL))
-                return true;
+        /* the king's square and both squares it crosses */
+        uint64_t path = BIT(SQUARE(y, 4)) | BIT(SQUARE(y, 4 + dx)) | BIT(SQUARE(y, 4 + 2*dx));
+        if(!(attacked_squares(ctx, inv_player(color)) & path))
+            return true;
     }
     return false;
 }
 
-bool legal_move(const struct chess_ctx *ctx, struct move_t move)
+/* whether gen_moves() would produce move for the side to move. Hash
+ * moves are checked at every node that has one, so this looks at the
+ * one move instead of generating them all */
+bool legal_move(struct chess_ctx *ctx, uint16_t move)
 {
-    switch(move.type)
-    {
-    case NORMAL:
-    {
-        struct coordinates from = move.data.normal.from;
+    int color = ctx->to_move, idx = COLOR_IDX(color);
+    int from = MOVE_FROM(move), to = MOVE_TO(move), promotion = MOVE_PROMOTION(move);
+    uint64_t own = ctx->occupied[idx], enemy = ctx->occupied[!idx];
+    uint64_t occ = own | enemy;
+    if(!(own & BIT(from)) || (own & BIT(to)))
+        return false;
 
-        if(move.color != ctx->board[from.y][from.x].color) /* moving a different piece */
-            return false;
+    int type = type_at(ctx, from);
+    bool promoting = type == PAWN && (SQ_Y(to) == 0 || SQ_Y(to) == 7);
+    if(promoting != (promotion != 0) || (promotion && (promotion < ROOK || promotion > QUEEN)))
+        return false;
 
-        struct legal_data data;
-        data.legal = false;
-        data.move = move;
-        for_each_move(ctx, move.data.normal.from.y, move.data.normal.from.x, legal_cb, &data, true, true);
-        return data.legal;
+    if(type == KING)
+    {
+        if(ABS(to - from) == 2 && SQ_Y(to) == SQ_Y(from))
+            return can_castle(ctx, color, to > from ? KINGSIDE : QUEENSIDE);
+        return (king_attacks[from] & BIT(to)) &&
+            !attackers_to(ctx, to, occ ^ BIT(from), inv_player(color));
     }
-    case CASTLE:
+
+    uint64_t kings = ctx->pieces[KING - 1] & own;
+    int ksq = kings ? lsb(kings) : -1;
+    if(type == PAWN)
     {
-        return can_castle(ctx, move.color, move.data.castle_style);
+        int up = color == WHITE ? 8 : -8;
+        if(pawn_attacks[idx][from] & BIT(to))
+        {
+            /* en passant looks at the king itself */
+            if(to == ctx->ep_square)
+                return en_passant_legal(ctx, color, ksq, from, to);
+            if(!(enemy & BIT(to)))
+                return false;
+        }
+        else if(to == from + 2 * up)
+        {
+            if(SQ_Y(from) != (color == WHITE ? 1 : 6) || (occ & (BIT(from + up) | BIT(to))))
+                return false;
+        }
+        else if(to != from + up || (occ & BIT(to)))
+            return false;
     }
-    default:
+    else if(!(piece_attacks(type, color, from, occ) & BIT(to)))
+        return false;
+
+    if(ksq < 0)
         return true;
-    }
+    uint64_t checkers = attackers_to(ctx, ksq, occ, inv_player(color));
+    if(checkers && (popcount(checkers) > 1 ||
+                    !(BIT(to) & (checkers | between_bb[ksq][lsb(checkers)]))))
+        return false;
+    return !(pinned_pieces(ctx, color, ksq) & BIT(from)) || (line_bb[ksq][from] & BIT(to));
 }
 
 struct chess_ctx new_game(void)
 {
-    struct chess_ctx ret;
-    memset(&ret.board, 0, sizeof(ret.board));
-    for(int i = 0; i < 8; ++i)
-    {
-        ret.board[1][i].color = WHITE;
-        ret.board[1][i].type = PAWN;
-        ret.board[6][i].color = BLACK;
-        ret.board[6][i].type = PAWN;
-    }
-
-    int types[] = { ROOK, KNIGHT, BISHOP };
-    for(int i = 0; i < 3; ++i)
-    {
-        ret.board[0][i].type = types[i];
-        ret.board[0][i].color = WHITE;
-        ret.board[0][7 - i].type = types[i];
-        ret.board[0][7 - i].color = WHITE;
-
-        ret.board[7][i].type = types[i];
-        ret.board[7][i].color = BLACK;
-        ret.board[7][7 - i].type = types[i];
-        ret.board[7][7 - i].color = BLACK;
-    }
-
-    ret.board[0][3].color = WHITE;
-    ret.board[0][3].type = QUEEN;
-    ret.board[0][4].color = WHITE;
-    ret.board[0][4].type = KING;
-
-    ret.board[7][3].color = BLACK;
-    ret.board[7][3].type = QUEEN;
-    ret.board[7][4].color = BLACK;
-    ret.board[7][4].type = KING;
-    ret.to_move = WHITE;
-
-    ret.king_moved[0] = false;
-    ret.king_moved[1] = false;
-    ret.rook_moved[0][0] = false;
-    ret.rook_moved[0][1] = false;
-    ret.rook_moved[1][0] = false;
-    ret.rook_moved[1][1] = false;
-
-    //return ret;
     return ctx_from_fen("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1", NULL);
 }
 
-struct move_t move_from_str(const struct chess_ctx *ctx, const char **line, int color)
+/* reads a move in long algebraic notation and steps *line past it;
+ * NOMOVE if it can't be one. Legality isn't checked */
+uint16_t move_from_str(const struct chess_ctx *ctx, const char **line)
 {
-    struct move_t ret;
-
     int x = (*line)[0] - 'a';
     int y = (*line)[1] - '1';
-    int dx = (*line)[2] - 'a' - x;
-    int dy = (*line)[3] - '1' - y;
-    if(valid_coords(y, x) && valid_coords(y + dy, x + dx) && (dx || dy))
-        ret = construct_move(color, y, x, dy, dx);
+    int tx = (*line)[2] - 'a';
+    int ty = (*line)[3] - '1';
     char piece = (*line)[4];
     *line += 5;
+
+    uint16_t ret = NOMOVE;
+    if(valid_coords(y, x) && valid_coords(ty, tx) && (x != tx || y != ty))
+        ret = MOVE(SQUARE(y, x), SQUARE(ty, tx));
     if(piece && piece != ' ' && piece != '\n')
     {
         /* promotion */
         (*line)++;
 
-        ret.type = PROMOTION;
-        ret.data.promotion.from = (struct coordinates) { y, x  };
-        ret.data.promotion.to = (struct coordinates) { y + dy, x + dx };
-        switch(toupper(piece))
-        {
-        case 'R':
-            ret.data.promotion.type = ROOK;
-            break;
-        case 'N':
-            ret.data.promotion.type = KNIGHT;
-            break;
-        case 'B':
-            ret.data.promotion.type = BISHOP;
-            break;
-        case 'Q':
-            ret.data.promotion.type = QUEEN;
-            break;
-        default:
-            ret.type = NOMOVE;
-            break;
-        }
+        const char *types = "rnbq"; /* ROOK to QUEEN */
+        const char *type = strchr(types, tolower(piece));
+        ret = ret && type ? ret | (ROOK + (type - types)) << 12 : NOMOVE;
     }
-
-    if(valid_coords(y, x) && ctx->board[y][x].type == PAWN &&
-       (y + dy == 0 || y + dy == 7) && ret.type != PROMOTION)
+    else if(ret && type_at(ctx, MOVE_FROM(ret)) == PAWN && (ty == 0 || ty == 7))
     {
-        ret.type = NOMOVE; /* we don't allow pawns on the 8th rank,
-                            * they must be promoted */
-    }
-
-    if(valid_coords(y, x) && x == 4 && y == (color == WHITE ? 0 : 7) &&
-       ctx->board[y][x].color == color && ctx->board[y][x].type == KING &&
-       ABS(dx) == 2 && dy == 0)
-    {
-        /* castle */
-        ret.type = CASTLE;
-        ret.data.castle_style = dx > 0 ? KINGSIDE : QUEENSIDE;
+        ret = NOMOVE; /* we don't allow pawns on the 8th rank,
+                       * they must be promoted */
     }
     return ret;
 }
@@ -1147,6 +1025,7 @@ struct chess_ctx ctx_from_fen(const char *fen, int *len)
     char *str = strdup(fen);
     char *old = str;
     struct chess_ctx ret, *ctx = &ret;
+    memset(ctx, 0, sizeof(*ctx));
     for(int i = 0; i < 8; ++i)
     {
         char *row = strtok_r(str, "/ ", &save);
@@ -1168,40 +1047,16 @@ struct chess_ctx ctx_from_fen(const char *fen, int *len)
                 {
                     goto invalid;
                 }
-                while(n--)
-                {
-                    ctx->board[y][x].type = EMPTY;
-                    ctx->board[y][x].color = NONE;
-                    x++;
-                }
+                x += n;
             }
             else if(isalpha(piece))
             {
-                ctx->board[y][x].color = isupper(piece) ? WHITE : BLACK;
-                piece = tolower(piece);
-                switch(piece)
-                {
-                case 'p':
-                    ctx->board[y][x].type = PAWN;
-                    break;
-                case 'r':
-                    ctx->board[y][x].type = ROOK;
-                    break;
-                case 'n':
-                    ctx->board[y][x].type = KNIGHT;
-                    break;
-                case 'b':
-                    ctx->board[y][x].type = BISHOP;
-                    break;
-                case 'q':
-                    ctx->board[y][x].type = QUEEN;
-                    break;
-                case 'k':
-                    ctx->board[y][x].type = KING;
-                    break;
-                default:
+                int color = isupper(piece) ? WHITE : BLACK;
+                const char *types = "prnbqk";
+                const char *type = strchr(types, tolower(piece));
+                if(!type)
                     goto invalid;
-                }
+                put_piece(ctx, SQUARE(y, x), PAWN + (type - types), color);
                 ++x;
             }
         }
@@ -1229,13 +1084,11 @@ struct chess_ctx ctx_from_fen(const char *fen, int *len)
         {
         case 'K':
         case 'k':
-            ctx->king_moved[idx] = false;
-            ctx->rook_moved[idx][1] = false;
+            ctx->castling |= CASTLE_BIT(idx, KINGSIDE);
             break;
         case 'Q':
         case 'q':
-            ctx->king_moved[idx] = false;
-            ctx->rook_moved[idx][0] = false;
+            ctx->castling |= CASTLE_BIT(idx, QUEENSIDE);
             break;
         case '-':
             break;
@@ -1246,8 +1099,8 @@ struct chess_ctx ctx_from_fen(const char *fen, int *len)
         tok++;
     }
 
-    memset(&ctx->en_passant, 0, sizeof(ctx->en_passant));
     tok = strtok_r(NULL, " ", &save);
+    ctx->ep_square = -1;
     switch(tolower(tok[0]))
     {
     case '-':
@@ -1261,13 +1114,17 @@ struct chess_ctx ctx_from_fen(const char *fen, int *len)
             printf("wrong en passant target (%u, %u, %s)\n", y, x, tok);
             goto invalid;
         }
-        ctx->en_passant[y == 2 ? 0 : 1][x] = true;
+        ctx->ep_square = SQUARE(y, x);
         break;
     }
     }
 
-    /* halfmove clock and fullmove number (both ignored) */
+    ctx->key = compute_key(ctx);
+
+    /* halfmove clock and fullmove number (ignored) */
     tok = strtok_r(NULL, " ", &save);
+    if(tok)
+        ctx->halfmove = MAX(MIN(atoi(tok), 100), 0); /* 100 is already a draw */
     tok = strtok_r(NULL, " ", &save);
 
     /* get address of rest of string */
@@ -1287,20 +1144,52 @@ invalid:
     assert(false);
 }
 
-void parse_moves(struct chess_ctx *ctx, const char *line, int len)
+void parse_moves(struct chess_ctx *ctx, struct key_history *history, const char *line, int len)
 {
     while(len > 3)
     {
         const char *before = line;
-        struct move_t move = move_from_str(ctx, &line, ctx->to_move);
-        execute_move(ctx, move);
+        uint16_t move = move_from_str(ctx, &line);
+        execute_move(ctx, history, move);
         len -= line - before;
     }
 }
 
-struct chess_ctx get_uci_ctx(int *wtime, int *btime, int *movetime)
+/* handles the "<id> value <x>" part of a setoption command */
+void set_option(char *line)
+{
+    char *value = strstr(line, " value ");
+    if(!value)
+        return;
+    *value = '\0';
+    value += 7;
+
+    if(!strcasecmp(line, "Hash"))
+        tt_resize(atoi(value));
+    else if(!strcasecmp(line, "Threads"))
+        search_threads = MAX(1, MIN(atoi(value), MAX_THREADS));
+    else if(!strcasecmp(line, "NullMove"))
+        null_move_enabled = !strcasecmp(value, "true");
+    else if(!strcasecmp(line, "NullMoveReduction"))
+        null_move_reduction = MAX(1, MIN(atoi(value), 4));
+    else if(!strcasecmp(line, "LateMoveReductions"))
+        lmr_enabled = !strcasecmp(value, "true");
+    else if(!strcasecmp(line, "LMRFullMoves"))
+        lmr_full_moves = MAX(1, MIN(atoi(value), MAX_MOVES));
+}
+
+/* background search control, defined with the search */
+static void start_search(const struct chess_ctx *ctx, const struct key_history *history,
+                         const struct search_limits *limits);
+static void stop_search(void);
+static void ponder_hit(void);
+
+/* reads UCI commands until quit or the end of input; searches run in
+ * the background so stop and ponderhit are seen while they do */
+void uci_loop(void)
 {
     struct chess_ctx ctx = new_game();
+    struct key_history history = { 0 };
     while(1)
     {
         char *ptr = NULL;
@@ -1308,7 +1197,14 @@ struct chess_ctx get_uci_ctx(int *wtime, int *btime, int *movetime)
         ssize_t len = getline(&ptr, &sz, stdin);
         char *line = ptr;
 
-        if(!line || !strlen(line))
+        if(len < 0 || !strncasecmp(line, "quit", 4))
+        {
+            free(ptr);
+            stop_search();
+            return;
+        }
+
+        if(!strlen(line))
         {
             free(line);
             continue;
@@ -1316,10 +1212,21 @@ struct chess_ctx get_uci_ctx(int *wtime, int *btime, int *movetime)
 
         //printf("received line: (%d, %d), \"%s\"\n", line, line[0], line);
 
-        if(!strncasecmp(line, "uci", 3))
+        if(!strncasecmp(line, "ucinewgame", 10))
+        {
+            stop_search();
+            tt_clear();
+        }
+        else if(!strncasecmp(line, "uci", 3))
         {
             printf("id name XenonChess\n");
             printf("id author Franklin Wei\n");
+            printf("option name Hash type spin default %d min 1 max 65536\n", DEFAULT_HASH_MB);
+            printf("option name Threads type spin default 1 min 1 max %d\n", MAX_THREADS);
+            printf("option name NullMove type check default true\n");
+            printf("option name NullMoveReduction type spin default 2 min 1 max 4\n");
+            printf("option name LateMoveReductions type check default true\n");
+            printf("option name LMRFullMoves type spin default 3 min 1 max %d\n", MAX_MOVES);
             printf("uciok\n");
             fflush(stdout);
         }
@@ -1328,58 +1235,93 @@ struct chess_ctx get_uci_ctx(int *wtime, int *btime, int *movetime)
             printf("readyok\n");
             fflush(stdout);
         }
+        else if(!strncasecmp(line, "setoption name ", 15))
+        {
+            stop_search();
+            set_option(line + 15);
+        }
+        else if(!strncasecmp(line, "stop", 4))
+        {
+            stop_search();
+        }
+        else if(!strncasecmp(line, "ponderhit", 9))
+        {
+            ponder_hit();
+        }
         else if(!strncasecmp(line, "position startpos moves ", 24))
         {
             printf("awaiting move string\n");
             ctx = new_game();
+            history.len = 0;
 
             line += 24;
             len -= 24;
-            parse_moves(&ctx, line, len);
+            parse_moves(&ctx, &history, line, len);
             print_ctx(&ctx);
         }
         else if(!strncasecmp(line, "go", 2))
         {
             char *save;
             char *tok;
+            struct search_limits limits;
+            init_limits(&limits);
             do {
-                tok = strtok_r(line, " ", &save);
+                tok = strtok_r(line, " \n", &save);
                 line = NULL;
                 if(!tok)
                     break;
-                if(!strcmp(tok, "wtime"))
+                if(!strcmp(tok, "infinite"))
                 {
-                    tok = strtok_r(line, " ", &save);
-                    if(tok && wtime)
-                        *wtime = atoi(tok);
+                    limits.infinite = true;
+                    continue;
                 }
-                else if(!strcmp(tok, "btime"))
+                if(!strcmp(tok, "ponder"))
                 {
-                    tok = strtok_r(line, " ", &save);
-                    if(tok && btime)
-                        *btime = atoi(tok);
+                    limits.ponder = true;
+                    continue;
                 }
+
+                /* everything else takes a number */
+                int *field = NULL;
+                if(!strcmp(tok, "wtime"))
+                    field = &limits.wtime;
+                else if(!strcmp(tok, "btime"))
+                    field = &limits.btime;
+                else if(!strcmp(tok, "winc"))
+                    field = &limits.winc;
+                else if(!strcmp(tok, "binc"))
+                    field = &limits.binc;
+                else if(!strcmp(tok, "movestogo"))
+                    field = &limits.movestogo;
                 else if(!strcmp(tok, "movetime"))
-                {
-                    tok = strtok_r(line, " ", &save);
-                    if(tok && movetime)
-                        *movetime = atoi(tok);
-                }
+                    field = &limits.movetime;
+                else if(!strcmp(tok, "depth"))
+                    field = &limits.depth;
+                else if(strcmp(tok, "nodes"))
+                    continue;
+
+                tok = strtok_r(line, " \n", &save);
+                if(tok && field)
+                    *field = atoi(tok);
+                else if(tok)
+                    limits.nodes = strtoull(tok, NULL, 10);
             } while(tok);
             //printf("wtime = %d, btime = %d\n", *wtime, *btime);
 
-            free(ptr);
-            return ctx;
+            stop_search();
+            start_search(&ctx, &history, &limits);
         }
         else if(!strcasecmp(line, "position startpos\n"))
         {
             //printf("info starting move \"%s\"\n", line);
             ctx = new_game();
+            history.len = 0;
         }
         else if(!strncasecmp(line, "position fen ", 13))
         {
             int fenlen;
             ctx = ctx_from_fen(line + 13, &fenlen);
+            history.len = 0;
 
             line += 13 + fenlen;
             len -= 13 + fenlen;
@@ -1388,16 +1330,20 @@ struct chess_ctx get_uci_ctx(int *wtime, int *btime, int *movetime)
             {
                 printf("line is \"%s\"\n", line);
 
-                parse_moves(&ctx, line, len);
+                parse_moves(&ctx, &history, line, len);
             }
             print_ctx(&ctx);
         }
         else if(!strncasecmp(line, "perft", 5))
         {
-            int depth;
-            if(sscanf(line, "perft %d\n", &depth) != 1)
-                depth = 4;
-            printf("info depth %d nodes %lu\n", depth, perft(&ctx, depth - 1));
+            /* perft <depth> [threads] [hash MB] */
+            int depth = 4, threads = search_threads, hash_mb = 0;
+            sscanf(line, "perft %d %d %d", &depth, &threads, &hash_mb);
+            int64_t start = ms_time();
+            uint64_t nodes = perft_divide(&ctx, depth - 1, threads, hash_mb);
+            int64_t elapsed = MAX(ms_time() - start, 1);
+            printf("info depth %d nodes %"PRIu64" time %"PRId64" nps %"PRIu64"\n", depth, nodes,
+                   elapsed, nodes * 1000 / elapsed);
             fflush(stdout);
         }
         else if(!strncasecmp(line, "eval", 4))
@@ -1405,82 +1351,219 @@ struct chess_ctx get_uci_ctx(int *wtime, int *btime, int *movetime)
             printf("info value WHITE: %d, BLACK: %d\n", eval_position(&ctx, WHITE), eval_position(&ctx, BLACK));
             fflush(stdout);
         }
+        else if(!strncasecmp(line, "see ", 4) && len >= 8)
+        {
+            /* see <move>: static exchange value of a move in the
+             * current position */
+            const char *str = line + 4;
+            uint16_t move = move_from_str(&ctx, &str);
+            if(legal_move(&ctx, move))
+                printf("info see %d\n", see(&ctx, move));
+            else
+                printf("info string illegal move\n");
+            fflush(stdout);
+        }
         free(ptr);
     }
 }
 
-struct perft_info {
-    uint64_t n;
-    int depth;
-};
-
-bool perft_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
+uint64_t perft(struct chess_ctx *ctx, int depth)
 {
-    struct perft_info *info = data;
+    struct move_list list;
+    gen_moves(ctx, ctx->to_move, &list, GEN_ALL);
+    if(depth <= 0)
+        return list.count;
 
-    if(info->depth > 0)
+    uint64_t n = 0;
+    bool hashed = perft_hash_enabled();
+    if(hashed && perft_hash_probe(ctx->key, depth, &n))
+        return n;
+
+    for(int i = 0; i < list.count; ++i)
     {
-        struct chess_ctx local = *ctx;
-        execute_move(&local, move);
-        uint64_t child = perft(&local, info->depth - 1);
-        if(info->depth == 5)
-        {
-            printf("move has %"PRIu64" children: ", child);
-            print_move(ctx, move);
-        }
-        info->n += child;
+        struct undo_t undo;
+        make_move(ctx, list.moves[i], &undo);
+        n += perft(ctx, depth - 1);
+        unmake_move(ctx, list.moves[i], &undo);
     }
-    else
-        info->n++;
 
-    return true;
+    if(hashed)
+        perft_hash_store(ctx->key, depth, n);
+    return n;
 }
 
-uint64_t perft(const struct chess_ctx *ctx, int depth)
+/* one unit of parallel perft work: a root move, optionally followed
+ * by one reply, counted down to the remaining depth */
+struct perft_job {
+    int root; /* index into the root move list */
+    int n_moves;
+    uint16_t moves[2];
+    uint64_t nodes;
+};
+
+struct perft_pool {
+    const struct chess_ctx *root;
+    struct perft_job *jobs;
+    int n_jobs;
+    int next_job; /* taken with an atomic increment */
+    int depth; /* perft() depth after the job's moves */
+};
+
+static void *perft_worker(void *data)
 {
-    struct perft_info info;
-    info.n = 0;
-    info.depth = depth;
-    for(int y = 0; y < 8; ++y)
+    struct perft_pool *pool = data;
+    int i;
+    while((i = __atomic_fetch_add(&pool->next_job, 1, __ATOMIC_RELAXED)) < pool->n_jobs)
+    {
+        struct perft_job *job = &pool->jobs[i];
+        struct chess_ctx ctx = *pool->root;
+        struct undo_t undo;
+        for(int m = 0; m < job->n_moves; ++m)
+            make_move(&ctx, job->moves[m], &undo);
+        job->nodes = pool->depth < 0 ? 1 : perft(&ctx, pool->depth);
+    }
+    return NULL;
+}
+
+/* perft() spread over several threads, printing the node count under
+ * each root move. With more than one thread the work is split at the
+ * second ply so a few big root moves can't leave threads idle. A
+ * nonzero hash_mb caches subtree counts in a table of that size for
+ * the duration of the call */
+uint64_t perft_divide(struct chess_ctx *ctx, int depth, int threads, int hash_mb)
+{
+    struct move_list root;
+    gen_moves(ctx, ctx->to_move, &root, GEN_ALL);
+
+    bool split = threads > 1 && depth >= 2;
+    int max_jobs = split ? root.count * MAX_MOVES : root.count;
+    struct perft_job *jobs = malloc(MAX(max_jobs, 1) * sizeof(*jobs));
+    struct perft_pool pool = { ctx, jobs, 0, 0, split ? depth - 2 : depth - 1 };
+
+    for(int i = 0; i < root.count; ++i)
     {
-        for(int x = 0; x < 8; ++x)
+        struct move_list replies;
+        replies.count = 0;
+        if(split)
         {
-            if(ctx->board[y][x].color == ctx->to_move)
-            {
-                /* recurse */
-                for_each_move(ctx, y, x, perft_cb, &info, true, true);
-            }
+            struct undo_t undo;
+            make_move(ctx, root.moves[i], &undo);
+            gen_moves(ctx, ctx->to_move, &replies, GEN_ALL);
+            unmake_move(ctx, root.moves[i], &undo);
+        }
+
+        /* a root move that ends the game has no replies to split on,
+         * and contributes nothing below depth 1 */
+        if(split && !replies.count)
+            continue;
+
+        for(int j = 0; j < MAX(replies.count, 1); ++j)
+        {
+            struct perft_job *job = &jobs[pool.n_jobs++];
+            job->root = i;
+            job->n_moves = split ? 2 : 1;
+            job->moves[0] = root.moves[i];
+            job->moves[1] = split ? replies.moves[j] : root.moves[i];
+            job->nodes = 0;
         }
     }
-    return info.n;
-}
 
-uint64_t pondered;
-int moveno;
+    perft_hash_resize(hash_mb);
+
+    threads = MAX(1, MIN(threads, MAX_THREADS));
+    pthread_t workers[MAX_THREADS];
+    int n_workers = 0;
+    for(; n_workers < threads - 1; ++n_workers)
+        if(pthread_create(&workers[n_workers], NULL, perft_worker, &pool))
+            break;
+    perft_worker(&pool);
+    for(int i = 0; i < n_workers; ++i)
+        pthread_join(workers[i], NULL);
+
+    uint64_t total = 0;
+    int job = 0;
+    for(int i = 0; i < root.count; ++i)
+    {
+        uint64_t child = 0;
+        while(job < pool.n_jobs && jobs[job].root == i)
+            child += jobs[job++].nodes;
+        printf("move has %"PRIu64" children: ", child);
+        print_move(ctx, root.moves[i]);
+        total += child;
+    }
+
+    free(jobs);
+    perft_hash_resize(0);
+    return total;
+}
 
-struct move_t get_move(const struct chess_ctx *ctx, enum player color)
+/* per-thread search state; thread 0 is the one that reports to the
+ * GUI and whose best move gets played */
+__thread uint64_t pondered;
+__thread int moveno;
+static __thread int thread_id = 0;
+static __thread unsigned int rand_seed = 1;
+
+/* the game's keys, then one for each move on the way to the node
+ * being searched */
+static __thread struct key_history search_keys;
+
+int search_threads = 1;
+
+/* pruning settings, changed through UCI options */
+bool null_move_enabled = true;
+int null_move_reduction = 2;
+bool lmr_enabled = true;
+int lmr_full_moves = 3; /* moves searched at full depth before reducing */
+
+/* set to make the helper threads give up their searches */
+static bool stop_helpers = false;
+
+/* set by the UCI thread to end the whole search early */
+static bool abort_search = false;
+
+/* deadlines of the current search in ms_time() terms, NO_DEADLINE for
+ * none: the hard one aborts a search, the soft one only keeps a new
+ * iteration from starting. A ponder search only gets them at
+ * ponderhit */
+#define NO_DEADLINE INT64_MAX
+static int64_t hard_stop = NO_DEADLINE, soft_stop = NO_DEADLINE;
+static int64_t soft_time; /* length of the soft limit, for extending it */
+
+/* a go nodes limit, counted by the main thread only */
+static uint64_t node_limit;
+
+/* the clock is only read every this many nodes, and a search that has
+ * run out stays out */
+#define POLL_NODES 1024
+static __thread uint64_t next_poll;
+static __thread bool timed_out;
+
+/* set while the first iteration runs, it is tiny and always finished
+ * so there is a move to return */
+static __thread bool finish_search;
+static uint64_t helper_pondered;
+
+uint16_t get_move(struct chess_ctx *ctx, enum player color)
 {
-    struct move_t ret;
+    uint16_t ret;
 again:
-    ret.type = NOMOVE;
+    ret = NOMOVE;
 
     char *ptr = NULL;
     size_t sz = 0;
     ssize_t len = getline(&ptr, &sz, stdin);
     char *line = ptr;
 
+    int king = SQUARE(color == WHITE ? 0 : 7, 4);
     if(!strncasecmp(line, "0-0-0", 5) || !strncasecmp(line, "O-O-O", 5))
     {
-        ret.color = color;
-        ret.type = CASTLE;
-        ret.data.castle_style = QUEENSIDE;
+        ret = MOVE(king, king - 2);
         goto done;
     }
     else if(!strncasecmp(line, "0-0", 3) || !strncasecmp(line, "O-O", 3))
     {
-        ret.color = color;
-        ret.type = CASTLE;
-        ret.data.castle_style = KINGSIDE;
+        ret = MOVE(king, king + 2);
         goto done;
     }
     else if(!strncasecmp(line, "uci", 3))
@@ -1499,15 +1582,15 @@ again:
     else if(!strncasecmp(line, "help", 4))
     {
         moveno = 0;
-        best_move_negamax(ctx, DEFAULT_DEPTH, -999999, 999999, color, &ret, DEFAULT_DEPTH, -1);
+        search_keys.len = 0;
+        best_move_negamax(ctx, DEFAULT_DEPTH, -999999, 999999, color, &ret, DEFAULT_DEPTH);
         goto done;
     }
     else if(!strncasecmp(line, "perft", 5))
     {
-        int depth;
-        if(sscanf(line, "perft %d\n", &depth) != 1)
-            depth = 4;
-        printf("info depth %d nodes %lu\n", depth, perft(ctx, depth - 1));
+        int depth = 4, threads = search_threads, hash_mb = 0;
+        sscanf(line, "perft %d %d %d", &depth, &threads, &hash_mb);
+        printf("info depth %d nodes %"PRIu64"\n", depth, perft_divide(ctx, depth - 1, threads, hash_mb));
         fflush(stdout);
         goto again;
     }
@@ -1523,7 +1606,7 @@ again:
         goto done;
     }
 
-    ret = move_from_str(ctx, (const char**)&line, color);
+    ret = move_from_str(ctx, (const char**)&line);
 
 done:
     free(ptr);
@@ -1531,47 +1614,277 @@ done:
     return ret;
 }
 
+#define MAX_PLY 128
+
+/* being mated n plies from the root scores -MATE_SCORE + n, so nearer
+ * mates score higher */
+#define MATE_SCORE 200000
+#define IS_MATE(score) (ABS(score) > MATE_SCORE - MAX_PLY)
+
+/* move ordering state, kept per thread: two quiet moves per ply that
+ * caused a beta cutoff, and a history score for every from/to pair */
+static __thread uint16_t killers[MAX_PLY][2];
+static __thread int history[2][64][64];
+static __thread int ply;
+
+/* set while searching the reply to a null move, so two aren't played
+ * in a row */
+static __thread bool after_null;
+
+/* triangular principal variation table: pv[ply] holds the best line
+ * found from that ply on, starting at index ply */
+static __thread uint16_t pv[MAX_PLY][MAX_PLY];
+static __thread int pv_length[MAX_PLY];
+
+/* piece types ranked by value for MVV-LVA */
+static const int order_rank[] = { 0, 1, 4, 2, 3, 5, 6 };
+
+enum { SCORE_HASH = 1 << 30, SCORE_CAPTURE = 1 << 28, SCORE_KILLER = 1 << 26 };
+
+#define HISTORY_MAX (1 << 20)
+
+static void clear_ordering(void)
+{
+    memset(killers, 0, sizeof(killers));
+    memset(history, 0, sizeof(history));
+}
+
+/* neither a capture nor a promotion */
+static bool is_quiet(const struct chess_ctx *ctx, uint16_t move)
+{
+    if(MOVE_PROMOTION(move))
+        return false;
+    int from = MOVE_FROM(move), to = MOVE_TO(move);
+    /* en passant is a pawn moving diagonally to an empty square */
+    return !type_at(ctx, to) &&
+        !(type_at(ctx, from) == PAWN && SQ_X(from) != SQ_X(to));
+}
+
+/* hash move, then captures by MVV-LVA and queen promotions, then
+ * killers, then quiet moves by history, then captures that lose
+ * material by how much they lose */
+static int score_move(const struct chess_ctx *ctx, uint16_t move, uint16_t hash_move)
+{
+    if(move == hash_move)
+        return SCORE_HASH;
+
+    int from = MOVE_FROM(move), to = MOVE_TO(move);
+    int victim = type_at(ctx, to);
+    if(MOVE_PROMOTION(move))
+        return MOVE_PROMOTION(move) == QUEEN ?
+            SCORE_CAPTURE + 8 * (order_rank[victim] + order_rank[QUEEN]) : -1;
+    if(!is_quiet(ctx, move))
+    {
+        /* taking something worth at least the capturing piece can't
+         * lose material, anything else has to be checked */
+        int attacker = type_at(ctx, from);
+        if(piece_values[victim ? victim : PAWN] < piece_values[attacker])
+        {
+            int gain = see(ctx, move);
+            if(gain < 0)
+                return gain;
+        }
+        return SCORE_CAPTURE + 8 * order_rank[victim ? victim : PAWN] -
+            order_rank[attacker];
+    }
+
+    if(ply < MAX_PLY && move == killers[ply][0])
+        return SCORE_KILLER + 1;
+    if(ply < MAX_PLY && move == killers[ply][1])
+        return SCORE_KILLER;
+    return history[COLOR_IDX(ctx->to_move)][from][to];
+}
+
+static void score_moves(const struct chess_ctx *ctx, const struct move_list *list,
+                        int *scores, uint16_t hash_move)
+{
+    for(int i = 0; i < list->count; ++i)
+        scores[i] = score_move(ctx, list->moves[i], hash_move);
+}
+
+/* one step of a selection sort: a cutoff usually comes long before
+ * the whole list would have been sorted */
+static uint16_t pick_move(struct move_list *list, int *scores, int i)
+{
+    int best = i;
+    for(int j = i + 1; j < list->count; ++j)
+        if(scores[j] > scores[best])
+            best = j;
+
+    uint16_t move = list->moves[best];
+    int score = scores[best];
+    list->moves[best] = list->moves[i];
+    scores[best] = scores[i];
+    list->moves[i] = move;
+    scores[i] = score;
+    return move;
+}
+
+/* called when a quiet move causes a beta cutoff */
+static void update_ordering(int color, uint16_t move, int depth)
+{
+    if(ply < MAX_PLY && killers[ply][0] != move)
+    {
+        killers[ply][1] = killers[ply][0];
+        killers[ply][0] = move;
+    }
+
+    int *h = &history[COLOR_IDX(color)][MOVE_FROM(move)][MOVE_TO(move)];
+    *h += depth * depth;
+    if(*h > HISTORY_MAX)
+    {
+        /* keep the scores below the killers */
+        int *all = &history[0][0][0];
+        for(unsigned int i = 0; i < sizeof(history) / sizeof(int); ++i)
+            all[i] /= 2;
+    }
+}
+
+/* move was the new best at this ply, its line is the move followed by
+ * the child's */
+static void update_pv(uint16_t move)
+{
+    if(ply + 1 >= MAX_PLY)
+        return;
+    pv[ply][ply] = move;
+    for(int i = ply + 1; i < pv_length[ply + 1]; ++i)
+        pv[ply][i] = pv[ply + 1][i];
+    pv_length[ply] = MAX(pv_length[ply + 1], ply + 1);
+}
+
+
+static void print_pv(void)
+{
+    printf(" pv");
+    for(int i = 0; i < pv_length[0]; ++i)
+    {
+        putchar(' ');
+        print_lan(pv[0][i]);
+    }
+    printf("\n");
+}
+
+static int64_t monotonic_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64_t)t.tv_sec * 1000 + t.tv_nsec / 1000000;
+}
+
+/* the monotonic clock counts from boot, ms_time() from here */
+static int64_t clock_base;
+
+void init_ms_time(void)
+{
+    clock_base = monotonic_ms();
+}
+
+/* milliseconds since init_ms_time() */
+int64_t ms_time(void)
+{
+    return monotonic_ms() - clock_base;
+}
+
+/* whether a search with this stop time should give up */
+static bool out_of_time(void)
+{
+    if(finish_search)
+        return false;
+    if(!timed_out && pondered >= next_poll)
+    {
+        next_poll = pondered + POLL_NODES;
+        int64_t stop_time = __atomic_load_n(&hard_stop, __ATOMIC_RELAXED);
+        timed_out = (stop_time != NO_DEADLINE && ms_time() > stop_time) ||
+            (thread_id == 0 && node_limit && pondered >= node_limit);
+    }
+    return timed_out || __atomic_load_n(&stop_helpers, __ATOMIC_RELAXED) ||
+        __atomic_load_n(&abort_search, __ATOMIC_RELAXED);
+}
+
 struct negamax_info {
     int best;
     int depth;
     int a, b;
     int full_depth;
-    int stop_time;
-    struct move_t move;
+    int searched; /* children searched so far */
+    bool in_check;
+    uint16_t move;
 };
 
-bool negamax_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
+/* adds the king move penalty to a score, leaving mate scores exact
+ * so nearer mates still score higher */
+static int penalize(int score, int penalty)
+{
+    return IS_MATE(score) ? score : score + penalty;
+}
+
+/* searches one child of the node described by info, returns false
+ * on a beta cutoff */
+static bool negamax_child(struct negamax_info *info, struct chess_ctx *ctx, uint16_t move)
 {
-    struct negamax_info *info = data;
-    struct chess_ctx local = *ctx;
+    struct undo_t undo;
 
     ++pondered;
 
     int king_penalty = 0;
-    if(move.type == NORMAL && ctx->board[move.data.normal.from.x][move.data.normal.from.y].type == KING)
+    struct piece_t moved = piece_at(ctx, MOVE_FROM(move));
+    if(moved.type == KING && ABS(SQ_X(MOVE_TO(move)) - SQ_X(MOVE_FROM(move))) != 2)
         king_penalty = 100;
 
-    if(king_in_check(ctx, ctx->to_move, NULL))
+    bool quiet = is_quiet(ctx, move);
+
+    /* the child's window, shifted by the penalty so v compares
+     * correctly against a and b */
+    int a = penalize(-info->b, -king_penalty), b = penalize(-info->a, -king_penalty);
+    int v;
+
+    push_key(&search_keys, ctx->key);
+    make_move(ctx, move, &undo);
+    ++ply;
+    if(!info->searched++)
+        v = -penalize(best_move_negamax(ctx, info->depth - 1, a, b, ctx->to_move, NULL, info->full_depth), king_penalty);
+    else
     {
-        if(info->full_depth < MAX_DEPTH)
-        {
-#ifdef CHECK_EXTENSIONS
-            info->depth++;
-            info->full_depth++;
-#endif
-        }
-    }
+        /* late move reductions: quiet moves this far down the list
+         * rarely turn out best, so they get a shallower search first
+         * (never at the root, or for checks and check evasions). ply
+         * already counts the child, the root's children are at 1 */
+        int reduction = 0;
+        if(lmr_enabled && quiet && !info->in_check && info->depth >= 3 &&
+           ply > 1 && info->searched > lmr_full_moves &&
+           !king_in_check(ctx, ctx->to_move, NULL))
+            reduction = 1;
+
+        /* principal variation search: with good ordering the first
+         * move is usually best, so the rest only need to be proven
+         * worse with a null window, and are searched again in full if
+         * that fails */
+        v = -penalize(best_move_negamax(ctx, info->depth - 1 - reduction, b - 1, b, ctx->to_move, NULL, info->full_depth), king_penalty);
+        if(reduction && v > info->a)
+            v = -penalize(best_move_negamax(ctx, info->depth - 1, b - 1, b, ctx->to_move, NULL, info->full_depth), king_penalty);
+        if(v > info->a && v < info->b)
+            v = -penalize(best_move_negamax(ctx, info->depth - 1, a, b, ctx->to_move, NULL, info->full_depth), king_penalty);
+    }
+    --ply;
+    unmake_move(ctx, move, &undo);
+    --search_keys.len;
+
+    /* the score of a search the clock cut short is meaningless */
+    if(out_of_time())
+        return true;
 
-    execute_move(&local, move);
-    int v = -(best_move_negamax(&local, info->depth - 1, -info->b, -info->a, local.to_move, NULL, info->full_depth, info->stop_time) + king_penalty);
-    if(v > info->best || (v == info->best && rand() % 8 == 2))
+    /* helpers break ties at random so they don't all follow the same
+     * lines; the main thread's move has to match its PV */
+    if(v > info->best || (v == info->best && thread_id != 0 && rand_r(&rand_seed) % 8 == 2))
     {
         info->best = v;
         info->move = move;
     }
+    if(v > info->a)
+        update_pv(move);
     info->a = MAX(info->a, v);
 
-    if(info->depth == info->full_depth)
+    if(ply == 0 && thread_id == 0)
     {
 #if defined(UCI) || DEFAULT_DEPTH > 3
         printf("info currmove ");
@@ -1597,120 +1910,487 @@ bool negamax_cb(void *data, const struct chess_ctx *ctx, struct move_t move)
     return true;
 }
 
-int ms_time(void)
+/* the table stores mate scores relative to the position instead of
+ * the root, since it can be reached at any ply */
+static int score_to_tt(int score)
 {
-    struct timespec t;
-    clock_gettime(CLOCK_MONOTONIC, &t);
-    return t.tv_sec * 1000 + t.tv_nsec / 1e6;
+    if(IS_MATE(score))
+        return score > 0 ? score + ply : score - ply;
+    return score;
+}
+
+static int score_from_tt(int score)
+{
+    if(IS_MATE(score))
+        return score > 0 ? score - ply : score + ply;
+    return score;
+}
+
+/* a capture that can't bring the score back up to alpha even with
+ * this much to spare isn't worth searching */
+#define DELTA_MARGIN 200
+
+/* searches captures and promotions only (all moves when in check)
+ * until the position is quiet, so leaves aren't scored in the middle
+ * of an exchange */
+static int quiesce(struct chess_ctx *ctx, int a, int b)
+{
+    ++pondered;
+
+    bool in_check = king_in_check(ctx, ctx->to_move, NULL);
+    int best = -99999999;
+    if(!in_check)
+    {
+        /* stand pat: the side to move can usually do at least as well
+         * as the static score by not capturing */
+        best = eval_position(ctx, ctx->to_move);
+        if(best >= b)
+            return best;
+        a = MAX(a, best);
+    }
+
+    struct move_list list;
+    gen_moves(ctx, ctx->to_move, &list, in_check ? GEN_ALL : GEN_CAPTURES);
+    if(!list.count && in_check) /* checkmate */
+        return -MATE_SCORE + ply;
+
+    int scores[MAX_MOVES];
+    score_moves(ctx, &list, scores, 0);
+    for(int i = 0; i < list.count; ++i)
+    {
+        uint16_t move = pick_move(&list, scores, i);
+        if(!in_check && !MOVE_PROMOTION(move))
+        {
+            /* en passant leaves the target empty, but takes a pawn */
+            int captured = type_at(ctx, MOVE_TO(move));
+            if(best + piece_values[captured ? captured : PAWN] + DELTA_MARGIN <= a)
+                continue;
+        }
+        /* ordering put underpromotions and captures that lose
+         * material last */
+        if(!in_check && scores[i] < 0)
+            break;
+
+        struct undo_t undo;
+        make_move(ctx, move, &undo);
+        ++ply;
+        int v = -quiesce(ctx, -b, -a);
+        --ply;
+        unmake_move(ctx, move, &undo);
+
+        best = MAX(best, v);
+        a = MAX(a, v);
+        if(a >= b)
+            break;
+    }
+    return best;
 }
 
-int best_move_negamax(const struct chess_ctx *ctx, int depth,
+int best_move_negamax(struct chess_ctx *ctx, int depth,
                       int a, int b, int color,
-                      struct move_t *best, int full_depth, int stop_time)
+                      uint16_t *best, int full_depth)
 {
+    (void) color; /* always the side to move */
+
     struct negamax_info info;
+    info.in_check = king_in_check(ctx, ctx->to_move, NULL);
+#ifdef CHECK_EXTENSIONS
+    /* look a ply further when in check so the horizon can't hide
+     * where the check leads; the checking move used up a ply of its
+     * own, so lines of checks still come to an end */
+    if(info.in_check && ply < MAX_DEPTH)
+        ++depth;
+#endif
+
     info.best = -99999999;
-    info.move.type = NOMOVE;
+    info.move = NOMOVE;
     info.depth = depth;
     info.full_depth = full_depth;
     info.a = a;
     info.b = b;
-    info.stop_time = stop_time;
+    info.searched = 0;
+
+    if(ply < MAX_PLY)
+        pv_length[ply] = ply;
+
+    bool null_allowed = !after_null;
+    after_null = false;
+
+    /* a repetition is scored as a draw the first time round: whatever
+     * led back here can be played again. Not at the root, which
+     * needs a move to play */
+    if(ply > 0 && (ctx->halfmove >= 100 || is_repetition(ctx, &search_keys)))
+        return 0;
 
     if(depth > 0)
     {
-        for(int y = 0; y < 8; ++y)
+        struct tt_entry entry;
+        uint16_t hash_move = 0;
+        if(tt_probe(ctx->key, &entry))
+        {
+            /* the root always searches so it has a move to return */
+            int bound = TT_BOUND(entry.gen_bound);
+            if(!best && entry.depth >= depth &&
+               (bound == TT_EXACT ||
+                (bound == TT_LOWER && entry.score >= b) ||
+                (bound == TT_UPPER && entry.score <= a)))
+                return score_from_tt(entry.score);
+            hash_move = entry.move;
+        }
+
+        /* null move pruning: if passing the turn still fails high
+         * at reduced depth, a real move almost certainly would. Not
+         * when in check, and not with only pawns left, where being
+         * forced to move (zugzwang) is common */
+        int idx = COLOR_IDX(ctx->to_move);
+        uint64_t big_pieces = ctx->occupied[idx] & ~(ctx->pieces[PAWN - 1] | ctx->pieces[KING - 1]);
+        if(null_move_enabled && null_allowed && !best && big_pieces &&
+           depth > null_move_reduction && !info.in_check)
         {
-            for(int x = 0; x < 8; ++x)
+            struct undo_t undo;
+            push_key(&search_keys, ctx->key);
+            make_null_move(ctx, &undo);
+            ++ply;
+            after_null = true;
+            int v = -best_move_negamax(ctx, depth - 1 - null_move_reduction, -b, -b + 1,
+                                       ctx->to_move, NULL, full_depth);
+            after_null = false;
+            --ply;
+            unmake_null_move(ctx, &undo);
+            --search_keys.len;
+            if(v >= b && !out_of_time())
+                return b;
+        }
+
+        /* the hash move (the previous iteration's best at the root) is
+         * tried before anything is generated, then captures; quiet
+         * moves are only generated if neither produced a cutoff, and
+         * captures that lose material wait until after them */
+        enum { STAGE_HASH = -1, STAGE_BAD_CAPTURES = -2 };
+        static const int stages[] = { STAGE_HASH, GEN_CAPTURES, GEN_QUIETS, STAGE_BAD_CAPTURES };
+        struct move_list bad;
+        int bad_scores[MAX_MOVES];
+        bad.count = 0;
+        for(unsigned int s = 0; s < ARRAYLEN(stages); ++s)
+        {
+            struct move_list list;
+            int scores[MAX_MOVES];
+            if(stages[s] == STAGE_HASH)
+            {
+                /* the entry may belong to a colliding position */
+                list.count = 0;
+                if(hash_move && legal_move(ctx, hash_move))
+                    list.moves[list.count++] = hash_move;
+                else
+                    hash_move = 0;
+                score_moves(ctx, &list, scores, hash_move);
+            }
+            else if(stages[s] == STAGE_BAD_CAPTURES)
+            {
+                list = bad;
+                memcpy(scores, bad_scores, bad.count * sizeof(int));
+            }
+            else
+            {
+                gen_moves(ctx, ctx->to_move, &list, stages[s]);
+                score_moves(ctx, &list, scores, hash_move);
+            }
+
+            for(int i = 0; i < list.count; ++i)
             {
-                if(stop_time > 0 && ms_time() > stop_time)
+                uint16_t move = pick_move(&list, scores, i);
+                if(stages[s] != STAGE_HASH && scores[i] == SCORE_HASH)
+                    continue;
+
+                /* the list is picked best first, so the rest are all
+                 * losing captures or underpromotions */
+                if(stages[s] == GEN_CAPTURES && scores[i] < 0)
                 {
-                    /* abort! */
-                    if(best)
-                        best->type = NOMOVE;
-                    printf("aborting depth %d search due to time\n", info.full_depth);
-                    return -99999999;
+                    for(int j = i; j < list.count; ++j)
+                    {
+                        bad.moves[bad.count] = list.moves[j];
+                        bad_scores[bad.count++] = scores[j];
+                    }
+                    break;
                 }
-                if(ctx->board[y][x].color == ctx->to_move)
+
+                /* abort, keeping what was finished: at the root that
+                 * is still a usable move */
+                if(out_of_time())
+                    goto cutoff;
+                /* recurse */
+                if(!negamax_child(&info, ctx, move))
                 {
-                    /* recurse */
-                    for_each_move(ctx, y, x, negamax_cb, &info, true, true);
+                    if(is_quiet(ctx, move))
+                        update_ordering(ctx->to_move, move, depth);
+                    goto cutoff;
                 }
             }
         }
+cutoff:
         if(best)
             *best = info.move;
+
+        /* a search cut short by the clock returns garbage, don't
+         * let it into the table */
+        if(info.move != NOMOVE && !out_of_time())
+        {
+            int bound = TT_EXACT;
+            if(info.best <= a)
+                bound = TT_UPPER;
+            else if(info.best >= b)
+                bound = TT_LOWER;
+            tt_store(ctx->key, depth, bound, score_to_tt(info.best),
+                     bound == TT_UPPER ? NOMOVE : info.move);
+        }
     }
-    if(!depth || info.move.type == NOMOVE) /* terminal node */
-        return eval_position(ctx, color);
+    if(!depth) /* horizon */
+        return quiesce(ctx, a, b);
+    if(info.move == NOMOVE) /* checkmate or stalemate */
+        return info.in_check ? -MATE_SCORE + ply : 0;
 
     return info.best;
 }
 
-struct move_t best_move(const struct chess_ctx *ctx, int stop_time)
+struct helper_t {
+    pthread_t thread;
+    int id;
+    struct chess_ctx ctx;
+    const struct key_history *history;
+    int max_depth;
+};
+
+/* lazy SMP: helpers search the same root on their own copy of the
+ * position and share results with the main thread only through the
+ * transposition table */
+static void *helper_main(void *data)
 {
-    struct move_t best;
-    best.type = NOMOVE;
-    if(stop_time < 0)
+    struct helper_t *helper = data;
+    thread_id = helper->id;
+    rand_seed = helper->id + 1;
+    pondered = 0;
+    next_poll = 0;
+    timed_out = false;
+    clear_ordering();
+    search_keys = *helper->history;
+
+    /* odd helpers run a ply ahead of the rest so the threads don't
+     * all search the same nodes in the same order */
+    for(int i = 1 + (helper->id & 1); i <= helper->max_depth && !out_of_time(); ++i)
     {
-        /* no time limit, default depth */
-        best_move_negamax(ctx, DEFAULT_DEPTH, -9999999, 9999999, ctx->to_move, &best, DEFAULT_DEPTH, stop_time);
-        return best;
+        uint16_t best;
+        best_move_negamax(&helper->ctx, i, -9999999, 9999999, helper->ctx.to_move, &best, i);
     }
-    for(int i = 1; i < MAX_DEPTH; ++i)
-    {
-        struct move_t old = best;
-        best_move_negamax(ctx, i, -9999999, 9999999, ctx->to_move, &best, i, old.type == NOMOVE ? -1 : stop_time);
-        if(ms_time() > stop_time)
+
+    __atomic_add_fetch(&helper_pondered, pondered, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* half width of the first window tried around the previous
+ * iteration's score */
+#define ASPIRATION_WINDOW 50
+
+static uint16_t iterative_deepening(struct chess_ctx *ctx, const struct key_history *history,
+                                    int max_depth)
+{
+    uint16_t best = NOMOVE;
+    int score = 0;
+    int64_t start = ms_time();
+    uint16_t previous = best;
+    next_poll = 0;
+    timed_out = false;
+    clear_ordering();
+    search_keys = *history;
+
+    for(int depth = 1; depth <= max_depth; ++depth)
+    {
+        /* most iterations land close to the last one's score, and a
+         * narrow window cuts off far more; if the score falls outside
+         * it, search again with the window widened on that side */
+        int a = -9999999, b = 9999999, delta = ASPIRATION_WINDOW;
+        if(depth > 1)
         {
-            if(old.type != NOMOVE)
+            a = MAX(score - delta, -9999999);
+            b = MIN(score + delta, 9999999);
+        }
+
+        for(;;)
+        {
+            uint16_t move;
+            finish_search = depth == 1;
+            int v = best_move_negamax(ctx, depth, a, b, ctx->to_move, &move, depth);
+            finish_search = false;
+            if(depth > 1 && out_of_time())
             {
-                printf("returning old result due to time\n");
-                return old;
+                /* a root move that beat alpha before time ran out was
+                 * searched completely and is better than the last
+                 * iteration's choice */
+                if(move != NOMOVE && v > a)
+                    best = move;
+                printf("aborting depth %d search due to time\n", depth);
+                return best;
             }
+
+            if(v <= a)
+                a = MAX(a - delta, -9999999);
+            else if(v >= b)
+                b = MIN(b + delta, 9999999);
             else
             {
-                printf("finishing search...\n");
-                /* finish the search, ignoring the time */
-                best_move_negamax(ctx, i, -9999999, 9999999, ctx->to_move, &best, i, -1);
-                return best;
+                score = v;
+                best = move;
+                break;
             }
+            delta *= 2;
         }
-        printf("after depth %d search, best move: ", i);
+
+        printf("info depth %d score ", depth);
+        if(IS_MATE(score)) /* in moves, negative when getting mated */
+            printf("mate %d", score > 0 ? (MATE_SCORE - score + 1) / 2 : -(MATE_SCORE + score) / 2);
+        else
+            printf("cp %d", score);
+        printf(" nodes %"PRIu64" time %"PRId64, pondered, ms_time() - start);
+        print_pv();
+        printf("after depth %d search, best move: ", depth);
         print_move(ctx, best);
+
+        int64_t soft = __atomic_load_n(&soft_stop, __ATOMIC_RELAXED);
+        if(soft != NO_DEADLINE)
+        {
+            /* a best move that is still changing needs a deeper look,
+             * give it more time, up to the hard deadline */
+            if(depth > 1 && best != previous)
+            {
+                soft = MIN(soft + __atomic_load_n(&soft_time, __ATOMIC_RELAXED) / 2,
+                           __atomic_load_n(&hard_stop, __ATOMIC_RELAXED));
+                __atomic_store_n(&soft_stop, soft, __ATOMIC_RELAXED);
+            }
+
+            /* the next iteration would most likely not finish */
+            if(ms_time() > soft)
+                break;
+        }
+        previous = best;
     }
     return best;
 }
 
-float calculate_phase(const struct chess_ctx *ctx)
+void init_limits(struct search_limits *limits)
+{
+    limits->wtime = limits->btime = limits->winc = limits->binc = -1;
+    limits->movestogo = 0;
+    limits->movetime = -1;
+    limits->depth = 0;
+    limits->nodes = 0;
+    limits->infinite = false;
+    limits->ponder = false;
+}
+
+/* time kept back for engine and GUI overhead */
+#define MOVE_OVERHEAD 20
+
+/* assumed number of moves left when the time control doesn't say */
+#define MOVES_TO_GO 30
+
+/* works out the soft and hard limits, in ms from now, on the time
+ * spent on this move; -1 means unlimited */
+static void allot_time(const struct search_limits *limits, int color, int *soft, int *hard)
 {
-    int mat = count_material(ctx, WHITE) + count_material(ctx, BLACK);
-    static int start_material = -1;
-    if(start_material < 0)
+    *soft = *hard = -1;
+    if(limits->infinite)
+        return;
+    if(limits->movetime > 0)
     {
-        struct chess_ctx new = new_game();
-        start_material = count_material(&new, WHITE) * 2;
+        *soft = *hard = MAX(limits->movetime - MOVE_OVERHEAD, 1);
+        return;
     }
-    int end_material = piece_values[KING] * 2;
-    return (float)(mat - start_material) / (float)(end_material - start_material);
+
+    int time = color == WHITE ? limits->wtime : limits->btime;
+    int inc = MAX(color == WHITE ? limits->winc : limits->binc, 0);
+    if(time < 0)
+        return;
+
+    int left = MAX(time - MOVE_OVERHEAD, 1);
+    int moves = limits->movestogo > 0 ? MIN(limits->movestogo, MOVES_TO_GO) : MOVES_TO_GO;
+
+    /* the soft limit is a fair share of the clock, the hard one lets
+     * an unstable search run well past it without risking a loss on
+     * time */
+    *soft = left / moves + inc * 3 / 4;
+    *hard = MIN(*soft * 4, left * 3 / 4);
+    *soft = MAX(MIN(*soft, *hard), 1);
+    *hard = MAX(*hard, 1);
 }
 
-#define INTERPOLATE(a, b, x) ((a) + ((b) - (a)) * (x))
+/* sets the deadlines of a search whose clock starts now */
+static void start_clock(const struct search_limits *limits, int color)
+{
+    int soft, hard;
+    int64_t now = ms_time();
+    allot_time(limits, color, &soft, &hard);
+    __atomic_store_n(&soft_time, (int64_t)soft, __ATOMIC_RELAXED);
+    __atomic_store_n(&soft_stop, soft < 0 ? NO_DEADLINE : now + soft, __ATOMIC_RELAXED);
+    __atomic_store_n(&hard_stop, hard < 0 ? NO_DEADLINE : now + hard, __ATOMIC_RELAXED);
+}
 
-void init_pst(const struct chess_ctx *ctx)
+/* called before a search starts */
+static void set_clock(const struct search_limits *limits, int color)
 {
-    memset(location_bonuses, 0, sizeof(location_bonuses));
-    float phase = calculate_phase(ctx);
-    printf("game phase is %f\n", phase);
-    for(int i = 0; i < 6; ++i)
-        for(int y = 0; y < 8; ++y)
-            for(int x = 0; x < 8; ++x)
-                location_bonuses[i][y][x] = INTERPOLATE(location_bonuses_early[i][y][x],
-                                                        location_bonuses_endgame[i][y][x],
-                                                        phase);
+    __atomic_store_n(&hard_stop, NO_DEADLINE, __ATOMIC_RELAXED);
+    __atomic_store_n(&soft_stop, NO_DEADLINE, __ATOMIC_RELAXED);
+    if(!limits->ponder)
+        start_clock(limits, color);
 }
 
-void print_status(const struct chess_ctx *ctx)
+/* the deadlines have to be set by set_clock() first */
+uint16_t best_move(struct chess_ctx *ctx, const struct key_history *history,
+                   const struct search_limits *limits)
+{
+    /* with nothing to stop it, a search only goes to the default depth */
+    bool unlimited = __atomic_load_n(&hard_stop, __ATOMIC_RELAXED) == NO_DEADLINE &&
+        !limits->nodes && !limits->infinite && !limits->ponder;
+    int max_depth = limits->depth;
+    if(max_depth <= 0)
+        max_depth = unlimited ? DEFAULT_DEPTH : MAX_DEPTH;
+    max_depth = MIN(max_depth, MAX_DEPTH);
+    node_limit = limits->nodes;
+
+    int n_helpers = search_threads - 1;
+    /* calloc() wouldn't keep each helper's position aligned */
+    struct helper_t *helpers;
+    if(posix_memalign((void **)&helpers, __alignof__(struct helper_t),
+                      MAX(n_helpers, 1) * sizeof(*helpers)))
+        assert(false);
+    memset(helpers, 0, MAX(n_helpers, 1) * sizeof(*helpers));
+
+    stop_helpers = false;
+    helper_pondered = 0;
+    for(int i = 0; i < n_helpers; ++i)
+    {
+        helpers[i].id = i + 1;
+        helpers[i].ctx = *ctx;
+        helpers[i].history = history;
+        helpers[i].max_depth = max_depth;
+        if(pthread_create(&helpers[i].thread, NULL, helper_main, &helpers[i]))
+        {
+            n_helpers = i;
+            break;
+        }
+    }
+
+    uint16_t best = iterative_deepening(ctx, history, max_depth);
+
+    __atomic_store_n(&stop_helpers, true, __ATOMIC_RELAXED);
+    for(int i = 0; i < n_helpers; ++i)
+        pthread_join(helpers[i].thread, NULL);
+    free(helpers);
+
+    /* report the nodes of all threads */
+    pondered += helper_pondered;
+    return best;
+}
+
+void print_status(struct chess_ctx *ctx)
 {
     (void) ctx;
 #ifndef UCI
@@ -1732,25 +2412,138 @@ void print_status(const struct chess_ctx *ctx)
 #endif
 }
 
+/* searches ctx and reports how fast it went; the clock has to be set
+ * with set_clock() first */
+static uint16_t think(struct chess_ctx *ctx, const struct key_history *history,
+                      const struct search_limits *limits)
+{
+    printf("info Thinking...\n");
+    pondered = 0;
+    moveno = 0;
+    clock_t start = clock();
+
+    tt_new_search();
+
+    uint16_t best = best_move(ctx, history, limits);
+    clock_t end = clock();
+    float time = (float)(end - start) / CLOCKS_PER_SEC;
+    if(time)
+    {
+        printf("info pondered %"PRIu64" moves in %.2f seconds (%.1f/sec)\n", pondered,
+               time, pondered / time);
+    }
+    return best;
+}
+
+/* the UCI search runs on a thread of its own so the UCI loop can keep
+ * reading commands; there is only ever one */
+static struct {
+    pthread_t thread;
+    bool running; /* started and not yet joined, UCI thread only */
+    struct chess_ctx ctx;
+    struct key_history history;
+    struct search_limits limits;
+    bool pondering; /* waiting for ponderhit, under lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} search_job = { .lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER };
+
+static void *search_main(void *data)
+{
+    (void) data;
+    uint16_t best = think(&search_job.ctx, &search_job.history, &search_job.limits);
+
+    /* UCI doesn't allow the move out before stop (or ponderhit when
+     * pondering), even if the search ended by itself */
+    pthread_mutex_lock(&search_job.lock);
+    while((search_job.pondering || search_job.limits.infinite) &&
+          !__atomic_load_n(&abort_search, __ATOMIC_RELAXED))
+        pthread_cond_wait(&search_job.cond, &search_job.lock);
+    pthread_mutex_unlock(&search_job.lock);
+
+    /* suggest the reply from the PV to ponder on */
+    printf("bestmove ");
+    print_lan(best);
+    if(best && pv_length[0] > 1 && pv[0][0] == best)
+    {
+        printf(" ponder ");
+        print_lan(pv[0][1]);
+    }
+    printf("\n");
+    fflush(stdout);
+    return NULL;
+}
+
+static void start_search(const struct chess_ctx *ctx, const struct key_history *history,
+                         const struct search_limits *limits)
+{
+    search_job.ctx = *ctx;
+    search_job.history = *history;
+    search_job.limits = *limits;
+    search_job.pondering = limits->ponder;
+    __atomic_store_n(&abort_search, false, __ATOMIC_RELAXED);
+    set_clock(limits, ctx->to_move);
+    if(pthread_create(&search_job.thread, NULL, search_main, NULL))
+        assert(false);
+    search_job.running = true;
+}
+
+/* ends the search in progress, if any, and waits for its move */
+static void stop_search(void)
+{
+    if(!search_job.running)
+        return;
+    pthread_mutex_lock(&search_job.lock);
+    __atomic_store_n(&abort_search, true, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&search_job.cond);
+    pthread_mutex_unlock(&search_job.lock);
+    pthread_join(search_job.thread, NULL);
+    search_job.running = false;
+}
+
+/* the opponent played the expected move: the ponder search carries on
+ * as a normal one, its clock starting now */
+static void ponder_hit(void)
+{
+    if(!search_job.running)
+        return;
+    pthread_mutex_lock(&search_job.lock);
+    if(search_job.pondering)
+    {
+        search_job.pondering = false;
+        start_clock(&search_job.limits, search_job.ctx.to_move);
+        pthread_cond_broadcast(&search_job.cond);
+    }
+    pthread_mutex_unlock(&search_job.lock);
+}
+
 int main()
 {
     printf("XenonChess\n");
+    init_ms_time();
+    init_bitboards();
+    init_zobrist();
+    tt_resize(DEFAULT_HASH_MB);
     unsigned int seed;
     int fd = open("/dev/urandom", O_RDONLY);
     read(fd, &seed, sizeof seed);
     srand(seed);
 
-#ifndef UCI
+#ifdef UCI
+    uci_loop();
+    return 0;
+#else
     struct chess_ctx ctx = new_game();
+    struct key_history history = { 0 };
     print_ctx(&ctx);
-#endif
 
     for(;;)
     {
+        struct search_limits limits;
+        init_limits(&limits);
 #ifndef AUTOMATCH
-#ifndef UCI
-        struct move_t player = get_move(&ctx, ctx.to_move);
-        if(player.type == NOMOVE)
+        uint16_t player = get_move(&ctx, ctx.to_move);
+        if(player == NOMOVE)
         {
             printf("Illegal\n");
             continue;
@@ -1762,54 +2555,26 @@ int main()
             continue;
         }
 
-        execute_move(&ctx, player);
+        execute_move(&ctx, &history, player);
 
         print_ctx(&ctx);
         print_status(&ctx);
-#else
-        int wtime = -1, btime = -1, movetime = -1;
-        struct chess_ctx ctx = get_uci_ctx(&wtime, &btime, &movetime);
 #endif
-#endif
-        int stop_time;
-        int think_time = movetime > 0 ? movetime : (ctx.to_move == WHITE ? wtime : btime) / 40;
-        if(think_time <= 0)
-            stop_time = -1;
-        else
-            stop_time = ms_time() + think_time;
-
-        printf("info Thinking...\n");
-        struct move_t best;
-        pondered = 0;
-        moveno = 0;
-        clock_t start = clock();
-
-        init_pst(&ctx);
-
-        best = best_move(&ctx, stop_time);
-        //best_move_negamax(&ctx, DEFAULT_DEPTH, -9999999, 9999999, ctx.to_move, &best, DEFAULT_DEPTH, stop_time);
-        clock_t end = clock();
-        float time = (float)(end - start) / CLOCKS_PER_SEC;
+        set_clock(&limits, ctx.to_move);
+        uint16_t best = think(&ctx, &history, &limits);
         printf("bestmove ");
         print_move(&ctx, best);
         fflush(stdout);
 
-        execute_move(&ctx, best);
-#ifndef UCI
+        execute_move(&ctx, &history, best);
         print_ctx(&ctx);
         print_status(&ctx);
-#endif
 
-        if(time)
-        {
-            printf("info pondered %"PRIu64" moves in %.2f seconds (%.1f/sec)\n", pondered,
-                   time, pondered / time);
-        }
-
-        if(best.type == NOMOVE)
+        if(best == NOMOVE)
         {
             printf("info Stalemate\n");
             return 0;
         }
     }
+#endif
 }
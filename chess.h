@@ -9,11 +9,25 @@
 #include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #define COORD_END 0xf00d
 #define ARRAYLEN(x) (sizeof(x)/sizeof((x)[0]))
 #define ABS(x) ((x)<0?-(x):(x))
 #define MAX(a, b) ((a)>(b)?(a):(b))
+#define MIN(a, b) ((a)<(b)?(a):(b))
+
+/* squares are numbered a1 = 0, b1 = 1, ..., h8 = 63 */
+#define SQUARE(y, x) ((y) * 8 + (x))
+#define SQ_Y(sq) ((sq) >> 3)
+#define SQ_X(sq) ((sq) & 7)
+#define BIT(sq) (1ULL << (sq))
+#define RANK_MASK(y) (0xffULL << (8 * (y)))
+#define FILE_MASK(x) (0x0101010101010101ULL << (x))
+
+/* index into per-color arrays */
+#define COLOR_IDX(c) ((c) == WHITE ? 0 : 1)
+#define inv_player(p) ((p)==WHITE?BLACK:WHITE)
 
 /* don't change any of these enum values */
 enum player { NONE = 0, WHITE = 1, BLACK = -1 };
@@ -28,48 +42,249 @@ struct coordinates {
     int y, x; /* 0-indexed */
 };
 
-struct promotion_t {
-    struct coordinates to, from;
-    enum piece type;
+/* moves are packed into 16 bits: 6 bits from square, 6 bits to
+ * square, 4 bits promotion piece. Castling is stored as the king's
+ * two-square move and en passant as the pawn's diagonal step onto an
+ * empty square, so the board tells them apart. 0 is no move */
+#define MOVE(from, to) ((uint16_t)((from) | (to) << 6))
+#define MOVE_FROM(m) ((m) & 63)
+#define MOVE_TO(m) (((m) >> 6) & 63)
+#define MOVE_PROMOTION(m) ((m) >> 12)
+#define NOMOVE 0
+
+enum { QUEENSIDE = 0, KINGSIDE };
+
+#define UNKNOWN -1
+
+#define MAX_THREADS 256
+
+/* more than the most legal moves any position can have */
+#define MAX_MOVES 256
+
+struct move_list {
+    uint16_t moves[MAX_MOVES];
+    int count;
 };
 
-struct move_t {
-    enum player color;
-    enum { NORMAL, CASTLE, PROMOTION, NOMOVE } type;
-    union {
-        struct { struct coordinates to, from; } normal;
-        enum { QUEENSIDE = 0, KINGSIDE } castle_style;
-        struct promotion_t promotion;
-    } data;
+/* what a UCI go command asked for; times are in ms, -1 when not given */
+struct search_limits {
+    int wtime, btime, winc, binc;
+    int movestogo; /* 0 when not given */
+    int movetime;
+    int depth; /* 0 for no limit */
+    uint64_t nodes; /* 0 for no limit */
+    bool infinite;
+    bool ponder; /* the clock only starts at ponderhit */
 };
 
-#define UNKNOWN -1
+/* a game keeps the last 100 keys, the most that can still repeat,
+ * and the search adds one per ply on top */
+#define MAX_HISTORY 512
 
+/* move generation stages */
+enum { GEN_CAPTURES = 0, GEN_QUIETS, GEN_ALL };
+
+/* 126 bytes, padded to 128 and aligned so a position takes exactly
+ * two cache lines: the bitboards fill the first, everything else the
+ * second. Copied for every search thread and perft job, so anything
+ * that can be worked out again, like attack maps, is kept elsewhere */
 struct chess_ctx {
-    struct piece_t board[8][8]; /* [rank (y)],[file (x)] */
-    enum player to_move;
-    bool king_moved[2];
-    bool rook_moved[2][2]; /* [player][0=first file (queenside),1=eighth file (kingside)] */
-    bool en_passant[2][8];
+    uint64_t pieces[6]; /* [type - 1], both colors */
+    uint64_t occupied[2]; /* [0=white,1=black] */
+    uint8_t mailbox[32]; /* a nibble per square, read through mailbox_get() */
+    uint64_t key; /* zobrist hash, kept up to date by make_move() */
+    uint64_t pawn_key; /* the same, of the pawns alone */
+
+    /* also kept up to date by make_move(): material plus piece-square
+     * bonuses, white's less black's, [0=middlegame,1=endgame], and the
+     * phase of the game, PHASE_MAX with all pieces on the board */
+    int psq[2];
+    int8_t phase;
+
+    int8_t to_move; /* WHITE or BLACK */
+    uint8_t castling; /* CASTLE_BIT()s of the rights still held */
+    int8_t ep_square; /* where a pawn can be taken en passant, -1 if nowhere */
+    int16_t halfmove; /* plies since the last capture or pawn move */
+} __attribute__((aligned(64)));
+
+/* the keys of the positions before each move made, oldest first, for
+ * spotting repetitions. Kept apart from chess_ctx, which is copied for
+ * every search thread and perft job */
+struct key_history {
+    int len;
+    uint64_t keys[MAX_HISTORY];
+};
+
+#define PHASE_MAX 24
+
+/* bit 0/1: white queenside/kingside, bit 2/3: black */
+#define CASTLE_BIT(idx, style) (1 << ((idx) * 2 + (style)))
+
+/* what make_move() needs to remember to take a move back */
+struct undo_t {
+    uint64_t key;
+    int16_t halfmove;
+    int8_t captured; /* mailbox value of the captured piece, 0 if none */
+    int8_t captured_sq; /* differs from the target for en passant */
+    uint8_t castling;
+    int8_t ep_square;
+};
+
+static inline int lsb(uint64_t bb)
+{
+    return __builtin_ctzll(bb);
+}
+
+static inline int msb(uint64_t bb)
+{
+    return 63 - __builtin_clzll(bb);
+}
+
+/* removes and returns the lowest set square */
+static inline int pop_lsb(uint64_t *bb)
+{
+    int sq = lsb(*bb);
+    *bb &= *bb - 1;
+    return sq;
+}
+
+static inline int popcount(uint64_t bb)
+{
+    return __builtin_popcountll(bb);
+}
+
+/* mailbox squares are packed two to a byte, the lower numbered one in
+ * the low nibble: the piece type, plus 8 for black */
+static inline int mailbox_get(const struct chess_ctx *ctx, int sq)
+{
+    int nibble = (ctx->mailbox[sq >> 1] >> ((sq & 1) * 4)) & 0xf;
+    return nibble & 8 ? -(nibble & 7) : nibble;
+}
+
+/* the type of the piece on sq, EMPTY if there is none */
+static inline int type_at(const struct chess_ctx *ctx, int sq)
+{
+    return (ctx->mailbox[sq >> 1] >> ((sq & 1) * 4)) & 7;
+}
+
+/* value is type * color, or EMPTY */
+static inline void mailbox_set(struct chess_ctx *ctx, int sq, int value)
+{
+    int shift = (sq & 1) * 4;
+    int nibble = value < 0 ? -value | 8 : value;
+    ctx->mailbox[sq >> 1] = (ctx->mailbox[sq >> 1] & ~(0xf << shift)) | nibble << shift;
+}
+
+static inline struct piece_t piece_at(const struct chess_ctx *ctx, int sq)
+{
+    int p = mailbox_get(ctx, sq);
+    return (struct piece_t) { ABS(p), p > 0 ? WHITE : (p < 0 ? BLACK : NONE) };
+}
+
+static inline uint64_t all_occupied(const struct chess_ctx *ctx)
+{
+    return ctx->occupied[0] | ctx->occupied[1];
+}
+
+/* bitboard.c */
+extern uint64_t knight_attacks[64];
+extern uint64_t king_attacks[64];
+extern uint64_t pawn_attacks[2][64]; /* [color idx][square] */
+extern uint64_t between_bb[64][64]; /* squares strictly between, if aligned */
+extern uint64_t line_bb[64][64]; /* whole line through both, if aligned */
+
+/* sliding attacks are looked up by the blockers on the relevant
+ * squares, hashed either with a magic multiply or, when built with
+ * USE_PEXT, with the BMI2 PEXT instruction */
+struct magic_t {
+    uint64_t mask; /* relevant occupancy, board edges excluded */
+    uint64_t magic;
+    uint64_t *attacks;
+    int shift;
 };
 
-int eval_position(const struct chess_ctx *ctx, int color);
-void execute_move(struct chess_ctx *ctx, struct move_t move);
-bool gen_and_call(const struct chess_ctx *ctx,
-                  int y, int x,
-                  int dy, int dx,
-                  bool (*cb)(void *data, const struct chess_ctx*, struct move_t),
-                  void *data, bool enforce);
-void for_each_move(const struct chess_ctx *ctx,
-                   int y, int x,
-                   bool (*cb)(void *data, const struct chess_ctx*, struct move_t),
-                   void *data, bool enforce_check, bool consider_castle);
-bool king_in_check(const struct chess_ctx *ctx, int color, struct coordinates *king);
+extern struct magic_t rook_magics[64];
+extern struct magic_t bishop_magics[64];
+
+#ifdef USE_PEXT
+#include <immintrin.h>
+#define magic_index(m, occ) _pext_u64((occ), (m)->mask)
+#else
+#define magic_index(m, occ) ((((occ) & (m)->mask) * (m)->magic) >> (m)->shift)
+#endif
+
+static inline uint64_t rook_attacks(int sq, uint64_t occ)
+{
+    const struct magic_t *m = &rook_magics[sq];
+    return m->attacks[magic_index(m, occ)];
+}
+
+static inline uint64_t bishop_attacks(int sq, uint64_t occ)
+{
+    const struct magic_t *m = &bishop_magics[sq];
+    return m->attacks[magic_index(m, occ)];
+}
+
+void init_bitboards(void);
+uint64_t rand64(uint64_t *state);
+uint64_t piece_attacks(int type, int color, int sq, uint64_t occ);
+uint64_t pawn_attacks_bb(uint64_t pawns, int color);
+uint64_t attackers_to(const struct chess_ctx *ctx, int sq, uint64_t occ, int color);
+uint64_t pinned_pieces(const struct chess_ctx *ctx, int color, int ksq);
+uint64_t attacked_squares(const struct chess_ctx *ctx, int color);
+bool attacks_cached(const struct chess_ctx *ctx, int color, uint64_t *attacks);
+
+/* tt.c */
+#define DEFAULT_HASH_MB 16
+
+/* what the stored score says about the real one */
+enum { TT_UPPER = 1, TT_LOWER = 2, TT_EXACT = 3 };
+
+#define TT_BOUND(gen_bound) ((gen_bound) & 3)
+#define TT_GEN(gen_bound) ((gen_bound) >> 2)
+
+struct tt_entry {
+    uint64_t key;
+    int32_t score;
+    uint16_t move; /* NOMOVE if none */
+    int8_t depth;
+    uint8_t gen_bound; /* search generation << 2 | bound, 0 if empty */
+};
+
+void tt_resize(int mb);
+void tt_clear(void);
+void tt_new_search(void);
+bool tt_probe(uint64_t key, struct tt_entry *out);
+void tt_store(uint64_t key, int depth, int bound, int score, uint16_t move);
+bool pawn_hash_probe(uint64_t key, int score[2]);
+void pawn_hash_store(uint64_t key, const int score[2]);
+void perft_hash_resize(int mb);
+bool perft_hash_enabled(void);
+bool perft_hash_probe(uint64_t key, int depth, uint64_t *nodes);
+void perft_hash_store(uint64_t key, int depth, uint64_t nodes);
+
+/* chess.c */
+extern int search_threads;
+extern bool null_move_enabled, lmr_enabled;
+extern int null_move_reduction, lmr_full_moves;
+int eval_position(struct chess_ctx *ctx, int color);
+void init_zobrist(void);
+uint64_t compute_key(const struct chess_ctx *ctx);
+void execute_move(struct chess_ctx *ctx, struct key_history *history, uint16_t move);
+bool is_repetition(const struct chess_ctx *ctx, const struct key_history *history);
+void make_move(struct chess_ctx *ctx, uint16_t move, struct undo_t *undo);
+void unmake_move(struct chess_ctx *ctx, uint16_t move, const struct undo_t *undo);
+int gen_moves(struct chess_ctx *ctx, int color, struct move_list *list, int stage);
+bool king_in_check(struct chess_ctx *ctx, int color, struct coordinates *king);
 void print_ctx(const struct chess_ctx *ctx);
-int best_move_negamax(const struct chess_ctx *ctx, int depth,
+int best_move_negamax(struct chess_ctx *ctx, int depth,
                       int a, int b,
-                      int color, struct move_t *best, int full, int stop_time);
-bool can_castle(const struct chess_ctx *ctx, int color, int style);
-uint64_t perft(const struct chess_ctx *ctx, int depth);
+                      int color, uint16_t *best, int full);
+bool can_castle(struct chess_ctx *ctx, int color, int style);
+int see(const struct chess_ctx *ctx, uint16_t move);
+void init_ms_time(void);
+int64_t ms_time(void);
+void init_limits(struct search_limits *limits);
+uint64_t perft(struct chess_ctx *ctx, int depth);
+uint64_t perft_divide(struct chess_ctx *ctx, int depth, int threads, int hash_mb);
 struct chess_ctx ctx_from_fen(const char *fen, int *len);
-extern int location_bonuses[6][8][8];
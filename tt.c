@@ -0,0 +1,221 @@
+#include "chess.h"
+
+#define BUCKET_SIZE 4
+
+/* the table is shared by every search thread without locking: each
+ * slot stores its key xored with its data, so a slot torn by two
+ * concurrent writers no longer matches any key and is simply a miss */
+struct tt_slot {
+    uint64_t check; /* key ^ data */
+    uint64_t data;
+};
+
+/* one cache line per bucket */
+struct tt_bucket {
+    struct tt_slot slots[BUCKET_SIZE];
+} __attribute__((aligned(64)));
+
+static struct tt_bucket *table = NULL;
+static uint64_t bucket_mask;
+static uint8_t generation;
+
+static uint64_t pack_entry(int score, uint16_t move, int depth, uint8_t gen_bound)
+{
+    return (uint32_t)score | (uint64_t)move << 32 |
+        (uint64_t)(uint8_t)depth << 48 | (uint64_t)gen_bound << 56;
+}
+
+static struct tt_entry unpack_entry(uint64_t key, uint64_t data)
+{
+    struct tt_entry e;
+    e.key = key;
+    e.score = (int32_t)(uint32_t)data;
+    e.move = data >> 32;
+    e.depth = (int8_t)(data >> 48);
+    e.gen_bound = data >> 56;
+    return e;
+}
+
+/* sizes the table to the largest power of two buckets that fits in
+ * mb megabytes, dropping its contents */
+void tt_resize(int mb)
+{
+    uint64_t bytes = (uint64_t)MAX(mb, 1) << 20;
+    uint64_t buckets = 1;
+    while(buckets * 2 * sizeof(struct tt_bucket) <= bytes)
+        buckets *= 2;
+
+    free(table);
+    if(posix_memalign((void **)&table, sizeof(struct tt_bucket),
+                      buckets * sizeof(struct tt_bucket)))
+        assert(false);
+    bucket_mask = buckets - 1;
+    tt_clear();
+}
+
+void tt_clear(void)
+{
+    memset(table, 0, (bucket_mask + 1) * sizeof(struct tt_bucket));
+    generation = 0;
+}
+
+/* entries left over from earlier searches become the first to go */
+void tt_new_search(void)
+{
+    generation = (generation + 1) & 0x3f;
+}
+
+bool tt_probe(uint64_t key, struct tt_entry *out)
+{
+    struct tt_bucket *bucket = &table[key & bucket_mask];
+    for(int i = 0; i < BUCKET_SIZE; ++i)
+    {
+        struct tt_slot *slot = &bucket->slots[i];
+        uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+        uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+        if((check ^ data) == key && data)
+        {
+            *out = unpack_entry(key, data);
+            return true;
+        }
+    }
+    return false;
+}
+
+void tt_store(uint64_t key, int depth, int bound, int score, uint16_t move)
+{
+    struct tt_bucket *bucket = &table[key & bucket_mask];
+    struct tt_slot *replace = &bucket->slots[0];
+    int worst = INT32_MAX;
+    for(int i = 0; i < BUCKET_SIZE; ++i)
+    {
+        struct tt_slot *slot = &bucket->slots[i];
+        uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+        uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+        struct tt_entry e = unpack_entry(check ^ data, data);
+        if(e.key == key)
+        {
+            /* keep the old best move if this search didn't find one */
+            if(!move)
+                move = e.move;
+            replace = slot;
+            break;
+        }
+
+        /* shallow entries from old searches are worth the least */
+        int value = e.depth - (TT_GEN(e.gen_bound) != generation ? 256 : 0);
+        if(value < worst)
+        {
+            worst = value;
+            replace = slot;
+        }
+    }
+
+    uint64_t data = pack_entry(score, move, depth, (generation << 2) | bound);
+    __atomic_store_n(&replace->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&replace->data, data, __ATOMIC_RELAXED);
+}
+
+/* pawn structure scores, keyed by the pawn key alone. The pawns
+ * change on few moves, so nearly every probe hits even in a small
+ * direct-mapped table; slots are xor checked like the main table */
+#define PAWN_HASH_SLOTS (1 << 16)
+#define PAWN_FILLED (1ULL << 32)
+
+static struct tt_slot pawn_table[PAWN_HASH_SLOTS];
+
+/* score is [0=middlegame,1=endgame], white's point of view */
+bool pawn_hash_probe(uint64_t key, int score[2])
+{
+    struct tt_slot *slot = &pawn_table[key & (PAWN_HASH_SLOTS - 1)];
+    uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+    uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+    if((check ^ data) != key || !(data & PAWN_FILLED))
+        return false;
+    score[0] = (int16_t)data;
+    score[1] = (int16_t)(data >> 16);
+    return true;
+}
+
+void pawn_hash_store(uint64_t key, const int score[2])
+{
+    struct tt_slot *slot = &pawn_table[key & (PAWN_HASH_SLOTS - 1)];
+    uint64_t data = PAWN_FILLED | (uint16_t)score[0] | (uint64_t)(uint16_t)score[1] << 16;
+    __atomic_store_n(&slot->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->data, data, __ATOMIC_RELAXED);
+}
+
+/* perft results are cached separately, keyed by position and depth.
+ * Counts are exact, so a hit has to be as well: the full key and depth
+ * must match, and slots use the same xor check as the main table */
+struct perft_bucket {
+    struct tt_slot slots[BUCKET_SIZE];
+} __attribute__((aligned(64)));
+
+static struct perft_bucket *perft_table = NULL;
+static uint64_t perft_mask;
+
+/* 0 frees the table and turns caching off */
+void perft_hash_resize(int mb)
+{
+    free(perft_table);
+    perft_table = NULL;
+    if(mb <= 0)
+        return;
+
+    uint64_t bytes = (uint64_t)mb << 20;
+    uint64_t buckets = 1;
+    while(buckets * 2 * sizeof(struct perft_bucket) <= bytes)
+        buckets *= 2;
+
+    if(posix_memalign((void **)&perft_table, sizeof(struct perft_bucket),
+                      buckets * sizeof(struct perft_bucket)))
+        assert(false);
+    memset(perft_table, 0, buckets * sizeof(struct perft_bucket));
+    perft_mask = buckets - 1;
+}
+
+bool perft_hash_enabled(void)
+{
+    return perft_table != NULL;
+}
+
+/* data is the node count << 8 | depth */
+bool perft_hash_probe(uint64_t key, int depth, uint64_t *nodes)
+{
+    struct perft_bucket *bucket = &perft_table[key & perft_mask];
+    for(int i = 0; i < BUCKET_SIZE; ++i)
+    {
+        struct tt_slot *slot = &bucket->slots[i];
+        uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+        uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+        if((check ^ data) == key && (int)(data & 0xff) == depth)
+        {
+            *nodes = data >> 8;
+            return true;
+        }
+    }
+    return false;
+}
+
+/* evicts the shallowest entry, deep counts save the most work */
+void perft_hash_store(uint64_t key, int depth, uint64_t nodes)
+{
+    struct perft_bucket *bucket = &perft_table[key & perft_mask];
+    struct tt_slot *replace = &bucket->slots[0];
+    int shallowest = INT32_MAX;
+    for(int i = 0; i < BUCKET_SIZE; ++i)
+    {
+        struct tt_slot *slot = &bucket->slots[i];
+        int slot_depth = __atomic_load_n(&slot->data, __ATOMIC_RELAXED) & 0xff;
+        if(slot_depth < shallowest)
+        {
+            shallowest = slot_depth;
+            replace = slot;
+        }
+    }
+
+    uint64_t data = nodes << 8 | depth;
+    __atomic_store_n(&replace->check, key ^ data, __ATOMIC_RELAXED);
+    __atomic_store_n(&replace->data, data, __ATOMIC_RELAXED);
+}